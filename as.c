@@ -1,6 +1,9 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <signal.h>
@@ -9,45 +12,113 @@
 #include <sys/stat.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <time.h>
 #include <dirent.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "as.h"
 
 /* Socket vars */
-int fd_tcp, fd_udp, fd_pdserver, errcode;
-ssize_t n, nw;
-socklen_t addrlen_tcp, addrlen_udp, addrlen_pdserver;
-struct addrinfo hints_tcp, hints_udp, hints_pdserver, *res_tcp, *res_udp, *res_pdserver;
-struct sockaddr_in addr_tcp, addr_udp, addr_pdserver, sa;
-char buffer[1024];
-struct timeval timeout;  // for timeout
+int fd_tcp, errcode;
+ssize_t n;
+struct addrinfo hints_tcp, hints_udp, *res_tcp, *res_udp;
 
 /* Comms info */
 char asport[8];
-char pdip[18], pdport[8];
 
 /* errno */
 extern int errno;
 
-/* Client info */
-char cip[18], cuid[6] = "";
-int cport;
-
-/* Validation data */
-int vc = 9999, tid = 9999, rid = 9999;
-char rop, rfname[26];
+/* Udp workers; each owns a SO_REUSEPORT socket */
+udp_worker workers[WORKERS_MAX];
+int nworkers = 1, batch_size = 16;
+
+/* Tcp workers; each multiplexes many sessions */
+tcp_worker tcp_workers[WORKERS_MAX];
+int ntcpworkers = 4;
+
+/* Session table; shared by udp and tcp servers */
+shared_state *shared;
+int persist_mode = 0;  // also write login.txt and tid.txt
+int vc_ttl = VC_TTL, tid_ttl = TID_TTL, login_ttl = LOGIN_TTL;  // s
+int max_ops = MAX_OPS;  // per user
+
+/* File servers told about each new tid; they fall back to VLD on a miss */
+struct sockaddr_in fs_push[FS_MAX];
+int nfs = 0;
+
+/* Admission control (-Q, -G); excess datagrams are shed unanswered; validations from known fss (-F, -f) skip it */
+int source_rate = 0, global_rate = 0;  // requests/s; 0 unlimited
+struct in_addr fs_known[FS_MAX];
+int nfs_known = 0;
+rate_bucket sources[RATE_SOURCES], global_bucket;
+pthread_mutex_t source_locks[RATE_STRIPES], global_lock;
+
+/* Shard map (-s); uids outside our ranges are redirected to their as */
+shard shards[SHARD_MAX];
+int nshards = 0;
+
+/* Token key shared with fss (-k); clients asking "AUT ... T" get signed tids */
+unsigned char token_key[KEY_MAX];
+int token_keylen = 0;
+
+/* Replication; a primary (-R) ships state changes, a replica (-r) follows one and serves VLD */
+char replport[8], replip[18] = "127.0.0.1";  // -R; loopback unless an address is given
+int fd_repl = -1, fd_replwake = -1;  // replica listen socket; eventfd poked on each append
+int nreplicas = 0;  // written by the shipper thread only
+int replica = 0;
+struct sockaddr_in repl_primary;
+uint32_t follow_epoch;  // replica side; read unlocked for stats and LAG
+uint64_t applied_seq, primary_seq;
+long long synced_at;  // ms; last time applied caught up with primary
+int repl_connected;
+int repl_logging = 0;  // ring in use: for replicas (-R) or the journal (-S)
+
+/* Snapshot (-S); state.snap is rewritten periodically and on SIGTERM, state.log journals changes in between */
+int snap_interval = SNAP_INTERVAL;  // s; 0 disables both
+int fd_journal = -1;
+uint64_t journal_next;  // next seq to journal; udp main thread only
+long long snap_at;  // ms; last snapshot
+
+/* Credential store; USERS/users.db mapped MAP_SHARED before fork */
+user_store *store;
+int store_created;  // first run; scan_store() imports USERS/<uid>/ files
+
+/* Random pool for vcs, tids and nonces; per thread */
+__thread uint16_t random_pool[RANDOM_POOL];
+__thread int random_left = 0;
+
+/* STA names; indexed by STAT_* and CODE_* */
+char *stat_names[STAT_OPS] = { "REG", "UNR", "VLD", "VLB", "LOG", "REQ", "AUT", "BRG", "PD" };
+char *code_names[STAT_CODES] = { "OK", "NOK", "ERR", "EPD", "ELOG", "EUSER", "EFOP", "E", "RDR" };
+long long started_at;  // us
 
 /* Verbose control flag */
 int verbose_mode = 0;
 
 
 void usage() {
-    fputs("usage: ./AS [-p ASport] [-v]\n", stderr);
+    fputs("usage: ./AS [-p ASport] [-v] [-d] [-b batch] [-w workers] [-t tcpworkers]\n"
+          "            [-V vcTTL] [-I tidTTL] [-L loginTTL] [-m maxops]\n"
+          "            [-f FSIP:FSport]... [-k keyfile] [-R [IP:]replport | -r ASIP:replport]\n"
+          "            [-s shardmap] [-S snapsecs] [-Q srcrate] [-G globalrate] [-F FSIP]...\n", stderr);
     exit(1);
 }
 
@@ -59,42 +130,83 @@ void kill_tcp(int signum) {  // kill child process if parent exits
 
 
 void kill_udp(int signum) {  // kill child process if parent exits
+    if (fd_journal != -1) save_snapshot();  // restart resumes from here
+
     disconnect_udpserver();
     exit(0);
 }
 
 
-void protocol_error_tcp() {  // basic protocol error; reply with "ERR\n"
-    char response[5];
+void dump_stats() {  // print udp batch-fill distribution, replication and pd breakers
+    unsigned long fill[BATCH_MAX + 1], calls = 0, datagrams = 0;
+    unsigned long priority = 0, shed_source = 0, shed_global = 0, hits = 0, misses = 0;
+    uint64_t behind;
+    long long lag;
+    pd_health *h;
+    int i, w;
 
-    bzero(response, 5);
-    strcpy(response, "ERR\n");
+    for (i = 1; i <= batch_size; i++) {
+        fill[i] = 0;
+        for (w = 0; w < nworkers; w++) fill[i] += workers[w].batch_fill[i];
+
+        calls += fill[i]; datagrams += i * fill[i];
+    }
+
+    fprintf(stdout, "AS stats: %lu datagrams in %lu batches (size %d, %d workers)\n",
+            datagrams, calls, batch_size, nworkers);
+
+    for (i = 1; i <= batch_size; i++)
+        if (fill[i]) fprintf(stdout, "  fill %2d: %lu\n", i, fill[i]);
+
+    for (w = 0; w < nworkers; w++) {
+        priority += workers[w].priority; shed_source += workers[w].shed_source; shed_global += workers[w].shed_global; }
+
+    fprintf(stdout, "Admission: %lu priority, %lu shed by source limit, %lu shed by global limit\n",
+            priority, shed_source, shed_global);
+
+    for (w = 0; w < nworkers; w++) { hits += workers[w].reply_hits; misses += workers[w].reply_misses; }
+
+    fprintf(stdout, "Reply cache: %lu hits, %lu misses, %lu bytes\n",
+            hits, misses, (unsigned long) nworkers * REPLY_CACHE * sizeof(reply_entry));
+
+    fprintf(stdout, "PD breakers: %lu trips, %lu recoveries, %lu fast fails, %lu probes\n",
+            shared->trips, shared->recoveries, shared->fast_fails, shared->probes);
+
+    if (replica) {
+        lag = replica_lag(&behind);
+        fprintf(stdout, "Replica: %s, %llu records applied, %llu behind, lag %lld ms\n",
+                repl_connected ? "following" : "disconnected", (unsigned long long) applied_seq,
+                (unsigned long long) behind, lag);
 
-    n = 5;
+    } else if (fd_repl != -1)
+        fprintf(stdout, "Replication: %llu records logged, %d replicas\n",
+                (unsigned long long) shared->repl_head, nreplicas);
 
-    while (n > 0) {  // write response
-        if ((nw = write(fd_tcp, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
+    /* unlocked scan; a breaker may change while printed */
+    for (i = 0; i < MAX_USERS; i++) {
+        h = &shared->users[i].health;
+
+        if (h->state != PD_CLOSED)
+            fprintf(stdout, "  %05d: %s (%d fails, %lu ok, %lu failed, srtt %d ms, cooldown %d ms)\n", i,
+                    h->state == PD_OPEN ? "open" : "probing", h->fails, h->ok, h->failed, h->srtt, h->cooldown);
     }
+}
 
-    disconnect_tcpserver();
 
-    exit(1);
+void protocol_error_tcp(tcp_session *s) {  // basic protocol error; reply with "ERR\n" and drop session
+    write_tcp(s, "ERR\n");
 
+    s->closing = 1;
 }
 
 
-void protocol_error_udp() {
+void protocol_error_udp(udp_worker *w) {  // reply with "ERR\n"; udp loop keeps running
     char response[5];
 
     bzero(response, 5);
     strcpy(response, "ERR\n");
 
-    // send response to pd, will timeout if lost
-    n = sendto(fd_udp, response, strlen(response), 0, (struct sockaddr*) &addr_udp, addrlen_udp);
-
-    exit(1);
-
+    reply_udp(w, response);  // queued; sent with the rest of the batch
 }
 
 
@@ -128,7 +240,9 @@ int is_only(int which, char *str) {  // check if string is only numeric, alpha,
         return 1;
 
     } else if (which == IP) {
-        int result = inet_pton(AF_INET, str, &(sa.sin_addr));
+        struct in_addr addr;  // local; called from udp workers
+
+        int result = inet_pton(AF_INET, str, &addr);
         return result != 0;
 
     } else if (which == OP) {
@@ -153,14 +267,15 @@ int is_only(int which, char *str) {  // check if string is only numeric, alpha,
 
 
 void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
+    char fsip[18], fsport[8], asip[18], rport[8];
     int opt;
 
-    if (argc > 4) usage();  // numargs in range
+    if (argc > 31 + 4 * FS_MAX) usage();  // numargs in range
 
     /* default values */
     strncpy(asport, "58046", 6);
 
-    while ((opt = getopt(argc, (char * const*) argv, "p:v")) != -1) {
+    while ((opt = getopt(argc, (char * const*) argv, "p:vdb:w:t:V:I:L:m:f:k:R:r:s:S:Q:G:F:")) != -1) {
         if (optarg && optarg[0] == '-') usage();
 
         switch (opt) {
@@ -179,16 +294,229 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 
                 break;
 
+            case 'd':
+                persist_mode = 1;
+
+                break;
+
+            case 'b':
+                batch_size = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || batch_size < 1 || batch_size > BATCH_MAX) usage();
+
+                break;
+
+            case 'w':
+                nworkers = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || nworkers < 1 || nworkers > WORKERS_MAX) usage();
+
+                break;
+
+            case 't':
+                ntcpworkers = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || ntcpworkers < 1 || ntcpworkers > WORKERS_MAX) usage();
+
+                break;
+
+            /* ttls in seconds; 0 disables expiry */
+            case 'V':
+                vc_ttl = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            case 'I':
+                tid_ttl = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            case 'L':
+                login_ttl = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            case 'm':
+                max_ops = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || max_ops < 1 || max_ops > MAX_OPS_LIMIT) usage();
+
+                break;
+
+            case 'f':
+                bzero(fsip, 18); bzero(fsport, 8);
+                if (nfs == FS_MAX || sscanf(optarg, "%17[^:]:%7s", fsip, fsport) != 2) usage();
+
+                if (!is_only(IP, fsip)) syntax_error(IP_INVALID);
+                if (strlen(fsport) > 5 || !is_only(NUMERIC, fsport) || atoi(fsport) > 65535)
+                    syntax_error(PORT_INVALID);
+
+                fs_push[nfs].sin_family = AF_INET;
+                inet_pton(AF_INET, fsip, &fs_push[nfs].sin_addr);
+                fs_push[nfs].sin_port = htons(atoi(fsport));
+                nfs++;
+
+                break;
+
+            case 'k':
+                read_key(optarg);
+
+                break;
+
+            case 'R':
+                bzero(asip, 18); bzero(rport, 8);
+                if (!strchr(optarg, ':')) strncpy(rport, optarg, 7);
+                else if (sscanf(optarg, "%17[^:]:%7s", asip, rport) != 2 || !is_only(IP, asip)) syntax_error(IP_INVALID);
+                else strcpy(replip, asip);
+
+                strncpy(replport, rport, 6);
+                if (strlen(replport) == 0 || strlen(replport) > 5 ||
+                    !is_only(NUMERIC, replport) || atoi(replport) > 65535)
+                    syntax_error(PORT_INVALID);
+
+                break;
+
+            case 'r':
+                bzero(asip, 18); bzero(rport, 8);
+                if (sscanf(optarg, "%17[^:]:%7s", asip, rport) != 2) usage();
+
+                if (!is_only(IP, asip)) syntax_error(IP_INVALID);
+                if (strlen(rport) > 5 || !is_only(NUMERIC, rport) || atoi(rport) > 65535)
+                    syntax_error(PORT_INVALID);
+
+                repl_primary.sin_family = AF_INET;
+                inet_pton(AF_INET, asip, &repl_primary.sin_addr);
+                repl_primary.sin_port = htons(atoi(rport));
+                replica = 1;
+
+                break;
+
+            case 's':
+                load_shards(optarg);
+
+                break;
+
+            case 'S':
+                snap_interval = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            /* requests per second; 0 disables the limit */
+            case 'Q':
+                source_rate = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            case 'G':
+                global_rate = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 7) usage();
+
+                break;
+
+            case 'F':
+                if (nfs_known == FS_MAX || !is_only(IP, optarg)) syntax_error(IP_INVALID);
+
+                inet_pton(AF_INET, optarg, &fs_known[nfs_known++]);
+
+                break;
+
             default:
                 usage();
         }
     }
+
+    if (replica && strlen(replport)) usage();  // no chained replicas
+    if (nfs && !token_keylen) usage();  // tid pushes are signed with the -k key
+    if ((strlen(replport) || replica) && !token_keylen) usage();  // so are replication subscriptions
+
+    if (nshards) own_shards();  // after -p
+}
+
+
+void load_shards(char *path) {  // "first last ip port" per line; '#' starts a comment
+    char line[128], first[8], last[8], ip[18], port[8], *p;
+    FILE *map = fopen(path, "r");
+    int i;
+
+    if (!map) { fputs("Error: Could not read shard map. Exiting...\n", stderr); exit(1); }
+
+    while (fgets(line, 128, map)) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        bzero(first, 8); bzero(last, 8); bzero(ip, 18); bzero(port, 8);
+        if (nshards == SHARD_MAX || sscanf(p, "%7s %7s %17s %7s", first, last, ip, port) != 4 ||
+            strlen(first) != 5 || !is_only(NUMERIC, first) || strlen(last) != 5 || !is_only(NUMERIC, last) ||
+            atoi(first) > atoi(last) || !is_only(IP, ip) || strlen(port) == 0 || strlen(port) > 5 ||
+            !is_only(NUMERIC, port) || atoi(port) > 65535) {
+            fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+
+        for (i = 0; i < nshards; i++)
+            if (atoi(first) <= shards[i].last && atoi(last) >= shards[i].first) {
+                fputs("Error: Shard map ranges overlap. Exiting...\n", stderr); exit(1); }
+
+        shards[nshards].first = atoi(first);
+        shards[nshards].last = atoi(last);
+        strcpy(shards[nshards].ip, ip);
+        sprintf(shards[nshards].port, "%d", atoi(port));
+        nshards++;
+    }
+
+    fclose(map);
+
+    if (!nshards) { fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+}
+
+
+void own_shards() {  // mark the map entries naming this host and port
+    struct ifaddrs *ifs, *i;
+    struct in_addr addr;
+    int s, owned = 0;
+
+    if (getifaddrs(&ifs) == -1) { fputs("Error: Could not read local addresses. Exiting...\n", stderr); exit(1); }
+
+    for (s = 0; s < nshards; s++) {
+        if (atoi(shards[s].port) != atoi(asport)) continue;
+
+        inet_pton(AF_INET, shards[s].ip, &addr);
+
+        for (i = ifs; i; i = i->ifa_next)
+            if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET &&
+                ((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr == addr.s_addr) {
+                shards[s].owned = 1; owned++; break; }
+    }
+
+    freeifaddrs(ifs);
+
+    if (!owned) { fputs("Error: No shard in the map is served by this AS. Exiting...\n", stderr); exit(1); }
+}
+
+
+shard *find_shard(char *uid) {  // map entry covering uid; NULL if none
+    int u = atoi(uid), i;
+
+    for (i = 0; i < nshards; i++)
+        if (u >= shards[i].first && u <= shards[i].last) return &shards[i];
+
+    return NULL;
 }
 
 
-void setup_udpserver() {  // sets up udp socket
-    fd_udp = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_udp == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
+int redirect(char *uid, char *prefix, char *fallback, char *response) {  // uid served elsewhere: "prefix RDR ip port"
+    shard *s;
+
+    if (!nshards || ((s = find_shard(uid)) && s->owned)) return 0;
+
+    if (s) sprintf(response, "%s RDR %s %s\n", prefix, s->ip, s->port);
+    else sprintf(response, "%s %s\n", prefix, fallback);  // no as has it
+
+    return 1;
+}
+
+
+void setup_udpserver() {  // sets up one udp socket per worker
+    int w, on = 1;
 
     memset(&hints_udp, 0, sizeof hints_udp);
     hints_udp.ai_family = AF_INET;
@@ -198,15 +526,30 @@ void setup_udpserver() {  // sets up udp socket
     errcode = getaddrinfo(NULL, asport, &hints_udp, &res_udp);
     if (errcode != 0) { fputs("Error: Could not get AS UDP address. Exiting...\n", stderr); exit(1); }
 
-    n = bind(fd_udp, res_udp->ai_addr, res_udp->ai_addrlen);
-    if (n == -1) { fputs("Error: Could not bind AS. Exiting...\n", stderr); exit(1); }
+    for (w = 0; w < nworkers; w++) {
+        workers[w].id = w;
+
+        workers[w].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (workers[w].fd == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
+
+        /* kernel spreads datagrams across the workers' sockets */
+        if (nworkers > 1 && setsockopt(workers[w].fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            fputs("Error: Could not set up AS UDP socket. Exiting...\n", stderr); exit(1); }
+
+        n = bind(workers[w].fd, res_udp->ai_addr, res_udp->ai_addrlen);
+        if (n == -1) { fputs("Error: Could not bind AS. Exiting...\n", stderr); exit(1); }
+    }
 }
 
 
 void setup_tcpserver() {  // set up tcp socket
+    int on = 1;
+
     fd_tcp = socket(AF_INET, SOCK_STREAM, 0);
     if (fd_tcp == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
 
+    setsockopt(fd_tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));  // restart while old sessions are in TIME_WAIT
+
     memset(&hints_tcp, 0, sizeof hints_tcp);
     hints_tcp.ai_family = AF_INET;
     hints_tcp.ai_socktype = SOCK_STREAM;
@@ -222,31 +565,55 @@ void setup_tcpserver() {  // set up tcp socket
 }
 
 
-int connect_to_pdserver() {  // connect to pd server
-    fd_pdserver = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_pdserver == -1) { strcpy(buffer, "RRQ EPD\n"); return 0; }
+void setup_replserver() {  // listen for replicas; before fork, so tcp server appends can wake the shipper
+    struct sockaddr_in addr;
+    int on = 1;
 
-    memset(&hints_pdserver, 0, sizeof hints_pdserver);
-    hints_pdserver.ai_family = AF_INET;
-    hints_pdserver.ai_socktype = SOCK_DGRAM;
+    fd_repl = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_repl == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
 
-    errcode = getaddrinfo(pdip, pdport, &hints_pdserver, &res_pdserver);
-    if (errcode != 0) { strcpy(buffer, "RRQ EPD\n"); return 0; }
+    setsockopt(fd_repl, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    if (setsockopt(fd_pdserver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        strcpy(buffer, "RRQ EPD\n"); return 0;
-    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, replip, &addr.sin_addr);
+    addr.sin_port = htons(atoi(replport));
 
-    return 1;
+    if (bind(fd_repl, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        fputs("Error: Could not bind AS replication port. Exiting...\n", stderr); exit(1); }
 
+    if (listen(fd_repl, REPL_MAX) == -1) { fputs("Error: Could not set up AS replication. Exiting...\n", stderr); exit(1); }
+
+    fd_replwake = eventfd(0, EFD_NONBLOCK);
+    if (fd_replwake == -1) { fputs("Error: Could not set up AS replication. Exiting...\n", stderr); exit(1); }
+
+    repl_logging = 1;
+}
+
+
+void setup_udpsocket(tcp_worker *w) {  // long-lived udp socket for this worker's vcs and tid pushes
+    struct epoll_event ev;
+    int on = 1;
+
+    w->fd_udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (w->fd_udp == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
+
+    /* queue icmp errors (pd port closed) with the pd's address; see receive_vc() */
+    if (setsockopt(w->fd_udp, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) == -1) {
+        fputs("Error: Could not set up PD socket. Exiting...\n", stderr); exit(1); }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->fd_epoll, EPOLL_CTL_ADD, w->fd_udp, &ev) == -1) {
+        fputs("Error: Could not set up PD socket. Exiting...\n", stderr); exit(1); }
 }
 
 
 void disconnect_udpserver() {  // standard udp disconnect
+    int w;
+
     freeaddrinfo(res_udp);
-    close(fd_udp);
+    for (w = 0; w < nworkers; w++) close(workers[w].fd);
 }
 
 
@@ -256,12 +623,6 @@ void disconnect_tcpserver() {  // standard tcp disconnect
 }
 
 
-void disconnect_from_pdserver() {  // standard udp disconnect
-    freeaddrinfo(res_pdserver);
-    close(fd_pdserver);
-}
-
-
 void change_to_dusers() {
     DIR *udir;
 
@@ -274,520 +635,2759 @@ void change_to_dusers() {
 }
 
 
-void generate_vc() { vc = rand() % 9000 + 1000; }  // generate a random vc between 1000 and 9999
-
-
-void generate_tid() { tid = rand() % 9000 + 1000; }  // generate a random tid between 1000 and 9999
+unsigned random_u16() {  // kernel randomness, buffered per thread; no lock, no shared seed across fork
+    if (!random_left) {
+        if (getrandom(random_pool, sizeof(random_pool), 0) != sizeof(random_pool)) {
+            fputs("Error: Could not get random bytes. Exiting...\n", stderr); exit(1); }
 
+        random_left = RANDOM_POOL;
+    }
 
-void register_user() {  // register a user
-    char request[128], response[128];
-    char uid[8], pass[10], storedpass[10];
-    FILE *passfile, *reg;
+    return random_pool[--random_left];
+}
 
-    bzero(request, 128);
-    strncpy(request, buffer, 127);
 
-    sscanf(request, "%*s %s %s %s %s", uid, pass, pdip, pdport);
+int random_code() {  // uniform between 1000 and 9999
+    unsigned v;
 
-    if (verbose_mode) fprintf(stdout, "%s: register (IP: %s | PORT: %d)\n", uid, cip, cport);
+    do v = random_u16(); while (v >= 7 * 9000);  // drop the uneven top of the range
 
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
-        !is_only(ALPHANUMERIC, pass) || !is_only(IP, pdip) || strlen(asport) == 0 ||
-        strlen(asport) > 5 || !is_only(NUMERIC, asport) || atoi(asport) > 65535)
-        strcpy(response, "RRG NOK\n");
+    return v % 9000 + 1000;
+}
 
-    else {
-        /* if not able to mkdir and not dir already exists */
-        if ((mkdir(uid, 0755)) != 0 && errno != EEXIST) strcpy(response, "RRG NOK\n");
 
-        chdir(uid);
+int generate_vc() { return random_code(); }  // generate a random vc between 1000 and 9999
 
-        strcpy(response, "RRG OK\n");  // default is reg ok
 
-        if ((passfile = fopen("pass.txt", "r"))) {
-            fscanf(passfile, "%s", storedpass);
+int generate_tid(char *uid) {  // random tid not live for uid; caller holds user lock
+    int tid;
 
-            /* if pass is different, reg nok */
-            if (strcmp(pass, storedpass) != 0) strcpy(response, "RRG NOK\n");
-            else {
-                /* write pd info if reg ok */
-                reg = fopen("reg.txt", "w");
-                fprintf(reg, "%s %s", pdip, pdport);
+    do tid = random_code(); while (find_op(get_user(uid), 0, tid));
 
-                fclose(passfile);
-                fclose(reg);
-            }
+    return tid;
+}
 
-        } else {
-            /* write pass info if user does not exist */
-            passfile = fopen("pass.txt", "w");
-            fprintf(passfile, "%s", pass);
 
-            /* write pd info if reg ok */
-            reg = fopen("reg.txt", "w");
-            fprintf(reg, "%s %s", pdip, pdport);
+long long now_ms() {  // monotonic clock in ms
+    struct timespec ts;
 
-            fclose(passfile);
-            fclose(reg);
-        }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-        chdir("..");
-    }
 
-    // send response to pd, will timeout if lost
-    n = sendto(fd_udp, response, strlen(response), 0, (struct sockaddr*) &addr_udp, addrlen_udp);
+long long wall_ms() {  // wall clock in ms; replicated expiries only
+    struct timespec ts;
 
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
 
-void unregister_user() {
-    char request[128], response[128];
-    char uid[8], pass[10], storedpass[10];
-    DIR *udir;
-    FILE *passfile;
-
-    bzero(request, 128);
-    strncpy(request, buffer, 127);
+long long now_us() {  // monotonic clock in us; latency stats
+    struct timespec ts;
 
-    sscanf(request, "%*s %s %s", uid, pass);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-    if (verbose_mode) fprintf(stdout, "%s: unregister (IP: %s | PORT: %d)\n", uid, cip, cport);
 
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
-        !is_only(ALPHANUMERIC, pass))
-        strcpy(response, "RUN NOK\n");
+int hist_bucket(long long us) {  // log-linear like hdr histograms: exact below HIST_SUB, then HIST_SUB per power of two
+    int e, bucket;
 
-    else {
-        udir = opendir(uid);
+    if (us < HIST_SUB) return us < 0 ? 0 : us;
 
-        if (!udir) strcpy(response, "RUN NOK\n");
-        else {
-            closedir(udir);
+    e = 63 - __builtin_clzll(us);  // floor(log2(us)) >= HIST_SUB_BITS
+    bucket = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
 
-            chdir(uid);
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
 
-            /* check password */
-            if ((passfile = fopen("pass.txt", "r"))) {
-                fscanf(passfile, "%s", storedpass);
 
-                /* if pass is different, unr nok */
-                if (strcmp(pass, storedpass) != 0) strcpy(response, "RUN NOK\n");
+long long hist_value(int bucket) {  // lowest value counted in bucket
+    if (bucket < HIST_SUB) return bucket;
 
-                fclose(passfile);
+    return (long long) (HIST_SUB + bucket % HIST_SUB) << (bucket / HIST_SUB - 1);
+}
 
-            } else strcpy(response, "RUN NOK\n");  // user not found
 
-            /* remove pd info */
-            if ((remove("reg.txt")) == -1) strcpy(response, "RUN NOK\n");
-            else strcpy(response, "RUN OK\n");
+int reply_code(char *response) {  // status word of a reply: "RRQ EPD" -> CODE_EPD; tids, ops and counts are CODE_OK
+    char word[8];
+    int i;
 
-            chdir("..");
-        }
-    }
+    bzero(word, 8);
 
-    // send response to pd, will timeout if lost
-    n = sendto(fd_udp, response, strlen(response), 0, (struct sockaddr*) &addr_udp, addrlen_udp);
-}
+    if (strncmp(response, "ERR", 3) == 0) return CODE_ERR;
+    if (strcmp(response, "RAU 0\n") == 0) return CODE_E;
 
+    if (strncmp(response, "CNF ", 4) == 0) sscanf(response, "%*s %*s %*s %7s", word);
+    else sscanf(response, "%*s %7s", word);
 
-void validate_operation() {
-    char request[128], response[128];
-    char uid[8], tid[6];
-    char storedtid[6], op, fname[26];
-    DIR *udir;
-    FILE *tidfile;
+    for (i = 1; i < STAT_CODES; i++) if (strcmp(word, code_names[i]) == 0) return i;
 
-    bzero(request, 128);
-    strncpy(request, buffer, 127);
+    return CODE_OK;
+}
 
-    sscanf(request, "%*s %s %s", uid, tid);
 
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(tid) != 4 ||
-        !is_only(NUMERIC, tid))
-        protocol_error_udp();
+void count_op(thread_stats *st, int op, char *response, long long started) {  // one answered request; calling thread owns st
+    op_stats *os = &st->ops[op];
+    long long us = now_us() - started;
 
-    if (verbose_mode) fprintf(stdout, "FS: validate %s (IP: %s | PORT: %d)\n", tid, cip, cport);
+    os->count++;
+    os->codes[reply_code(response)]++;
+    os->hist[hist_bucket(us)]++;
+    if (us > os->max) os->max = us;
+}
 
-    udir = opendir(uid);
 
-    if (!udir) sprintf(response, "CNF %s %s E\n", uid, tid);
-    else {
-        closedir(udir);
+long long percentile(op_stats *os, double q) {  // upper edge of the bucket holding the q-th value, in us
+    unsigned long rank = q * os->count, seen = 0;
+    int i;
 
-        chdir(uid);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += os->hist[i];
+        if (seen > rank) break;
+    }
 
-        /* check tid */
-        if ((tidfile = fopen("tid.txt", "r"))) {
-            fscanf(tidfile, "%s %c %s", storedtid, &op, fname);  // read tid, op and filename (optional)
+    if (i >= HIST_BUCKETS - 1) return os->max;
 
-            /* if pass is different, unr nok */
-            if (strcmp(tid, storedtid) != 0) sprintf(response, "CNF %s %s E\n", uid, tid);  // invalid tid
-            else {
-                if (op == 'R' || op == 'U' || op == 'D') sprintf(response, "CNF %s %s %c %s\n", uid, tid, op, fname);
-                else if (op == 'L' || op == 'X') sprintf(response, "CNF %s %s %c\n", uid, tid, op);
-                else sprintf(response, "CNF %s %s E\n", uid, tid);  // unknown op
-            }
+    return hist_value(i + 1) - 1 < os->max ? hist_value(i + 1) - 1 : os->max;
+}
 
-            fclose(tidfile);
 
-        } else sprintf(response, "CNF %s %s E\n", uid, tid);  // user not found
+void timer_init(timer_wheel *tw, long long now) {  // empty wheel at tick now
+    int l, i;
 
-        chdir("..");
-    }
+    for (l = 0; l < WHEEL_LEVELS; l++)
+        for (i = 0; i < WHEEL_SLOTS; i++) tw->slots[l][i].prev = tw->slots[l][i].next = &tw->slots[l][i];
 
-    // send response to pd, will timeout if lost
-    n = sendto(fd_udp, response, strlen(response), 0, (struct sockaddr*) &addr_udp, addrlen_udp);
+    tw->now = now;
 }
 
 
-int send_vc(char *uid, char op, char *fname) {
-    char request[128], response[128];
-    char ruid[8], status[5];
-    FILE *reg;
+void timer_del(timer_node *n) {  // disarm; no-op if not armed
+    if (!n->next) return;
 
-    bzero(request, 128);
-    bzero(buffer, 128);
-
-    /* check if operation involves fname */
-    if (strcmp(fname, "") == 0) sprintf(request, "VLC %s %d %c\n", uid, vc, op);
-    else sprintf(request, "VLC %s %d %c %s\n", uid, vc, op, fname);
-
-    chdir(uid);
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+}
 
-    strcpy(response, "RRG OK\n");  // default is reg ok
 
-    // get pd info
-    if ((reg = fopen("reg.txt", "r"))) fscanf(reg, "%s %s", pdip, pdport);
+void timer_link(timer_wheel *tw, timer_node *n) {  // put n in the slot for its expiry
+    long long when = n->expires, delta;
+    timer_node *head;
+    int l;
 
-    if (!connect_to_pdserver()) return 0;
+    if (when <= tw->now) when = tw->now + 1;  // already due; next tick
+    delta = when - tw->now;
 
-    n = sendto(fd_pdserver, request, strlen(request), 0, res_pdserver->ai_addr, res_pdserver->ai_addrlen);
-    if (n == -1) { strcpy(buffer, "RRQ EPD\n"); return 0; }  // if not able to send
+    /* lowest level whose range covers it; past the top level park it at the far end */
+    for (l = 0; l < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_BITS * (l + 1)); l++);
+    if (delta >= 1LL << (WHEEL_BITS * WHEEL_LEVELS)) when = tw->now + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
 
-    bzero(response, 128);
+    head = &tw->slots[l][(when >> (WHEEL_BITS * l)) & WHEEL_MASK];
 
-    addrlen_pdserver = sizeof(addr_pdserver);
-    n = recvfrom(fd_pdserver, response, 128, 0,( struct sockaddr *) &addr_pdserver, &addrlen_pdserver);
-    if (n == -1) { strcpy(buffer, "RRQ EPD\n"); return 0; }  // if not able to receive
-    response[n] = '\0';
+    n->prev = head;
+    n->next = head->next;
+    head->next->prev = n;
+    head->next = n;
+}
 
-    sscanf(response, "%*s %s %s", ruid, status);
-    if (strcmp(ruid, uid) != 0 || strcmp(status, "OK") != 0) {
-        strcpy(buffer, "RRQ EUSER\n"); return 0; }
 
-    disconnect_from_pdserver();
+void timer_set(timer_wheel *tw, timer_node *n, long long expires) {  // (re)arm n for tick expires
+    timer_del(n);
 
-    return 1;
+    n->expires = expires;
+    timer_link(tw, n);
 }
 
 
-void login_user() {
-    char response[128], request[128];
-    char uid[8], pass[10], storedpass[10];
-    FILE *login, *passfile;
-    DIR *udir;
+void timer_advance(timer_wheel *tw, long long now, timer_node *due) {  // run ticks up to now; expired nodes move to due
+    timer_node *head, *n;
+    int l;
 
-    bzero(request, 128);
-    bzero(buffer, 128);
-    if ((n = read(fd_tcp, buffer, 127)) > 0)
-        strncpy(request, buffer, 127);  // read request code + space
+    while (tw->now < now) {
+        tw->now++;
 
-    sscanf(request, "%s %s", uid, pass);
+        /* a level wrapped; spread the next slot of the level above over the ones below */
+        for (l = WHEEL_LEVELS - 1; l > 0; l--) {
+            if (tw->now & ((1LL << (WHEEL_BITS * l)) - 1)) continue;
 
-    bzero(response, 128);
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
-        !is_only(ALPHANUMERIC, pass))
-        strcpy(response, "RLO ERR\n");
+            head = &tw->slots[l][(tw->now >> (WHEEL_BITS * l)) & WHEEL_MASK];
+            while ((n = head->next) != head) { timer_del(n); timer_link(tw, n); }
+        }
 
+        head = &tw->slots[0][tw->now & WHEEL_MASK];
+        while ((n = head->next) != head) {
+            timer_del(n);
 
-    if (verbose_mode) fprintf(stdout, "%s: login (IP: %s | PORT: %d)\n", uid, cip, cport);
+            n->prev = due->prev;
+            n->next = due;
+            due->prev->next = n;
+            due->prev = n;
+        }
+    }
+}
 
-    udir = opendir(uid);
 
-    if (!udir) strcpy(response, "RLO ERR\n");  // check if user exists
-    else {
-        closedir(udir);
+long long to_ticks(long long ms) { return (ms + WHEEL_TICK - 1) / WHEEL_TICK; }  // rounded up; deadlines
 
-        chdir(uid);
 
-        passfile = fopen("pass.txt", "r");
+long long tick_now() { return now_ms() / WHEEL_TICK; }  // rounded down; a node fires once its deadline has passed
 
-        if (!passfile) strcpy(response, "RLO ERR\n");  // user removed
-        else {
-            fscanf(passfile, "%s", storedpass);  // check if pass is ok
 
-            /* if pass is different, log nok */
-            if (strcmp(pass, storedpass) != 0) strcpy(response, "RLO NOK\n");
-            else {
-                strcpy(response, "RLO OK\n");
+int expired(long long expires) { return expires && expires <= now_ms(); }  // 0 never expires
 
-                login = fopen("login.txt", "w");  // create temp login file
-                fclose(login);
 
-                bzero(cuid, 6);
-                strcpy(cuid, uid);
-            }
-        }
+void arm_expiry(op_slot *o, int ttl) {  // set vc/tid deadline; caller holds user lock
+    pthread_mutex_lock(&shared->wheel_lock);
 
-        chdir("..");
+    if (!ttl) { o->expires = 0; timer_del(&o->timer); }
+    else {
+        o->expires = now_ms() + ttl * 1000LL;
+        timer_set(&shared->wheel, &o->timer, to_ticks(o->expires));
     }
 
-    n = strlen(response);
-
-    while (n > 0) {  // write response
-        if ((nw = write(fd_tcp, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
-    }
+    pthread_mutex_unlock(&shared->wheel_lock);
 }
 
 
-void request_operation() {
-    char response[128], request[128];
-    char uid[8], op[3], fname[32];
-    DIR* udir;
+void arm_expiry_at(op_slot *o, long long expires) {  // as arm_expiry(), with a monotonic deadline; caller holds user lock
+    pthread_mutex_lock(&shared->wheel_lock);
 
-    bzero(request, 128);
-    bzero(buffer, 128);
-    if ((n = read(fd_tcp, buffer, 127)) > 0)
-        strncpy(request, buffer, 127);  // read request code + space
+    o->expires = expires;
+    if (!expires) timer_del(&o->timer);
+    else timer_set(&shared->wheel, &o->timer, to_ticks(expires));
 
-    sscanf(request,"%s %d %2s %s", uid, &rid, op, fname);
+    pthread_mutex_unlock(&shared->wheel_lock);
+}
 
-    bzero(response, 128);
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || rid < 0 || rid > 9999)
-        strcpy(response, "RRQ ERR\n");
 
-    if (!is_only(OP, op)) strcpy(response, "RRQ FOP\n");
+int *tid_bucket(int uid, int tid) {  // head of the index chain for (uid, tid)
+    return &shared->tid_index[uid % LOCK_STRIPES][(unsigned) (uid * 10000 + tid) * 2654435761u >> (32 - TID_BUCKET_BITS)];
+}
 
-    if (strchr("RUD", op[0])|| !is_only(FILENAME, fname)) {
-        strcpy(response, "RRQ ERR\n");
 
-        if (verbose_mode) fprintf(stdout, "%s: request - %c %s (IP: %s | PORT: %d)\n", uid, op[0], fname, cip, cport);
+void set_tid(op_slot *o, int tid) {  // issue (or drop, tid 0) o's tid and keep the index in step; caller holds user lock
+    int i = o - shared->ops, *pi;
 
-    } else {
-        strcpy(fname, "");
+    if (o->tid == tid) return;
 
-        if (verbose_mode) fprintf(stdout, "%s: request - %c (IP: %s | PORT: %d)\n", uid, op[0], cip, cport);
+    if (o->tid) {
+        for (pi = tid_bucket(o->uid, o->tid); *pi; pi = &shared->ops[*pi].tid_next)
+            if (*pi == i) { *pi = o->tid_next; break; }
     }
 
-    udir = opendir(uid);
-
-    if (!udir) strcpy(response, "RRQ EUID\n");
-    else {
-        closedir(udir);
-
-        chdir(uid);
+    o->tid = tid;
 
-        if (fopen("login.txt", "r")) {
-            generate_vc();
+    if (tid) {
+        pi = tid_bucket(o->uid, tid);
+        o->tid_next = *pi;
+        *pi = i;
+    }
+}
 
-            if (send_vc(uid, op[0], fname)) {
-                strcpy(response, "RRQ OK\n");
 
-                /* save op info */
-                rop = op[0];
-                strcpy(rfname, fname);
+op_slot *find_op(user_session *u, int rid, int tid) {  // pending op with rid, or issued op with tid; caller holds user lock
+    int uid = u - shared->users;
+    op_slot *o;
+    int i;
 
-            } else strcpy(response, buffer);  // if error use buffer info
-        } else strcpy(response, "RRQ EUSER\n");  // user not found
+    /* tids through the index; rids are few per user */
+    if (tid) {
+        for (i = *tid_bucket(uid, tid); i; i = o->tid_next) {
+            o = &shared->ops[i];
+            if (o->uid == uid && o->tid == tid && !expired(o->expires)) return o;
+        }
 
-        chdir("..");
-        
+        return NULL;
     }
 
-    n = strlen(response);
+    for (i = u->ops; i; i = o->next) {
+        o = &shared->ops[i];
 
-    while (n > 0) {  // write response
-        if ((nw = write(fd_tcp, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
+        if (expired(o->expires)) continue;  // wheel has not reclaimed it yet
+        if (!o->tid && o->rid == rid) return o;
     }
+
+    return NULL;
 }
 
 
-void authenticate_operation() {
-    char request[128], response[128];
-    char uid[8];
-    int rvc, rrid;
-    FILE *tidfile;
-    DIR *udir;
+op_slot *new_op(char *uid) {  // take a slot from the pool into user's chain; NULL if at limit or pool empty
+    user_session *u = get_user(uid);
+    op_slot *o;
+    int i;
 
-    bzero(buffer, 128);
-    bzero(request, 128);
-    if ((n = read(fd_tcp, buffer, 127)) > 0)
-        strncpy(request, buffer, 127);  // read request code + space
+    if (u->nops >= max_ops && !replica) return NULL;  // replicas mirror whatever the primary allowed
 
-    sscanf(request,"%s %d %d", uid, &rrid, &rvc);
+    pthread_mutex_lock(&shared->pool_lock);
 
-    bzero(response, 128);
-    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || rrid < 0 ||
-        rrid > 9999 || rvc < 0 || rvc > 9999)
-        strcpy(response, "RAU 0\n");
+    /* reuse freed slots first; fresh ones are handed out in order so untouched pages stay unmapped */
+    if ((i = shared->free_ops)) shared->free_ops = shared->ops[i].next;
+    else if (shared->used_ops < OP_POOL) i = ++shared->used_ops;
 
-    if (verbose_mode) fprintf(stdout, "%s: authenticate - %d (IP: %s | PORT: %d)\n", uid, rvc, cip, cport);
+    pthread_mutex_unlock(&shared->pool_lock);
 
-    if (rvc != vc) strcpy(response, "RAU 0\n");
-    else {
-        generate_tid();
+    if (!i) return NULL;
 
-        sprintf(response, "RAU %d\n", tid);
+    o = &shared->ops[i];
+    memset(o, 0, sizeof(op_slot));
+    o->uid = atoi(uid);
 
-        udir = opendir(uid);
+    o->next = u->ops;
+    u->ops = i;
+    u->nops++;
 
-        if (udir) {
-            closedir(udir);
+    return o;
+}
 
-            chdir(uid);
 
-            /* create tid file */
-            tidfile = fopen("tid.txt", "w");
-            if (tidfile) {
-                if (strcmp(rfname, "") == 0) fprintf(tidfile, "%d %c", tid, rop);
-                else fprintf(tidfile, "%d %c %s", tid, rop, rfname);
-            }
+void free_op(user_session *u, op_slot *o) {  // unlink from user's chain and return to pool; caller holds user lock
+    int i = o - shared->ops, *pi;
 
-            fclose(tidfile);
+    for (pi = &u->ops; *pi; pi = &shared->ops[*pi].next)
+        if (*pi == i) { *pi = o->next; break; }
 
-            chdir("..");
-        }
-    }
+    u->nops--;
+    set_tid(o, 0);
+    o->uid = -1;
 
-    n = strlen(response);
+    pthread_mutex_lock(&shared->wheel_lock);
+    timer_del(&o->timer);
+    pthread_mutex_unlock(&shared->wheel_lock);
 
-    while (n > 0) {  // write response
-        if ((nw = write(fd_tcp, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
-    }
+    pthread_mutex_lock(&shared->pool_lock);
+    o->next = shared->free_ops;
+    shared->free_ops = i;
+    pthread_mutex_unlock(&shared->pool_lock);
 }
 
 
-void handle_udp() {
-    char rcode[5];
-    pid_t pid, ppid;
-    struct sigaction act;
+void save_tids(char *uid) {  // rewrite tid.txt with user's live tids, one per line; caller holds user lock
+    char path[32];
+    user_session *u = get_user(uid);
+    FILE *tidfile;
+    op_slot *o;
+    int i, n = 0;
 
-    while (1) {
-        addrlen_udp = sizeof(addr_udp);
-        n = recvfrom(fd_udp, buffer, 128, 0, (struct sockaddr*) &addr_udp, &addrlen_udp);
-        if (n == -1) { fputs("Error: Could not get response from server. Try again!\n", stderr); return; }
-        else buffer[n] = '\0';
+    sprintf(path, "%s/tid.txt", uid);
+    mkdir(uid, 0755);
+
+    tidfile = fopen(path, "w");
+    if (!tidfile) return;
 
-        /* avoid zombie processes */
-        act.sa_handler = SIG_IGN;
-        if (sigaction(SIGCHLD, &act, NULL) == -1) exit(1);
+    for (i = u->ops; i; i = o->next) {
+        o = &shared->ops[i];
+        if (!o->tid) continue;
 
-        ppid = getpid();
-        pid = fork();
+        if (strcmp(o->fname, "") == 0) fprintf(tidfile, "%d %c\n", o->tid, o->op);
+        else fprintf(tidfile, "%d %c %s\n", o->tid, o->op, o->fname);
+        n++;
+    }
 
-        if (pid == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+    fclose(tidfile);
 
-        /* fork; process request if child, continue if parent */
-        if (pid) continue;
-        else {
-            signal(SIGTERM, kill_udp);  // kill fs sub-server if SIGTERM received
-            setvbuf(stdout, NULL, _IONBF, 0);  // make stdout unbuffered
+    if (!n) remove(path);
+}
 
-            n = prctl(PR_SET_PDEATHSIG, SIGTERM);  // send SIGTERM to child if parent exits
-            if (n == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
 
-            if (getppid() != ppid) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+void setup_shared() {  // map session table before fork so both servers share it
+    pthread_mutexattr_t attr;
+    int i;
 
-            strcpy(cip, inet_ntoa(addr_udp.sin_addr));
-            cport = ntohs(addr_udp.sin_port);
+    /* anonymous shared pages; untouched users cost no memory */
+    shared = mmap(NULL, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) { fputs("Error: Could not set up session table. Exiting...\n", stderr); exit(1); }
 
-            strncpy(rcode, buffer, 4);
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
 
-            /* perform operation acording to rcode; error if invalid */
-            if (strcmp(rcode, "REG ") == 0) register_user();
-            else if (strcmp(rcode, "UNR ") == 0) unregister_user();
-            else if (strcmp(rcode, "VLD ") == 0) validate_operation();
-            else protocol_error_udp();
+    for (i = 0; i < LOCK_STRIPES; i++) pthread_mutex_init(&shared->locks[i], &attr);
 
-            disconnect_udpserver();  // disconnects udp sub-server
+    pthread_mutex_init(&shared->wheel_lock, &attr);
+    pthread_mutex_init(&shared->pool_lock, &attr);
+    pthread_mutex_init(&shared->repl_lock, &attr);
+    timer_init(&shared->wheel, tick_now());
 
-            exit(0);  // child exits if successful
+    shared->repl_epoch = (random_u16() << 16 | random_u16()) | 1;  // nonzero; replicas send 0 until their first snapshot
 
-        }
-    }
+    pthread_mutexattr_destroy(&attr);
 }
 
 
-void handle_tcp() {  // receive requests from tcp socket
-    char rcode[5];
-    pid_t pid, ppid;
-    struct sigaction act;
-    int newfd;
-    int ret;
+user_session *get_user(char *uid) { return &shared->users[atoi(uid)]; }  // uid must be 5 digits
 
-    /* avoid zombie processes */
-    act.sa_handler = SIG_IGN;
-    if (sigaction(SIGCHLD, &act, NULL) == -1) exit(1);
 
-    /* wait for connections */
-    while (1) {
-        addrlen_tcp = sizeof(addr_tcp);
+uint32_t record_sum(user_record *rec) {  // fnv-1a over everything after gen and sum
+    unsigned char *p = (unsigned char*) rec + 2 * sizeof(uint32_t);
+    uint32_t sum = 2166136261u;
+    size_t i;
 
-        do newfd = accept(fd_tcp, (struct sockaddr*) &addr_tcp, &addrlen_tcp); while (newfd == -1 && errno == EINTR);
-        if (newfd == -1) exit(EXIT_FAILURE);
+    for (i = 0; i < sizeof(user_record) - 2 * sizeof(uint32_t); i++) { sum ^= p[i]; sum *= 16777619u; }
 
-        ppid = getpid();
-        pid = fork();
+    return sum;
+}
 
-        if (pid == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
 
-        /* fork; continue listening if parent, perform operation if child */
-        if (pid) {
-            do ret = close(newfd); while(ret == -1 && errno == EINTR);  // close new socket
-            if (ret == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+int current_copy(user_slot *slot) {  // index of newest intact copy; -1 if none
+    int ok0 = slot->copy[0].gen && slot->copy[0].sum == record_sum(&slot->copy[0]);
+    int ok1 = slot->copy[1].gen && slot->copy[1].sum == record_sum(&slot->copy[1]);
 
-        } else {
-            signal(SIGTERM, kill_tcp);  // kill fs sub-server if SIGTERM received
-            setvbuf(stdout, NULL, _IONBF, 0);  // make stdout unbuffered
+    if (ok0 && ok1) return slot->copy[1].gen > slot->copy[0].gen;
+    return ok0 ? 0 : (ok1 ? 1 : -1);
+}
 
-            n = prctl(PR_SET_PDEATHSIG, SIGTERM);  // send SIGTERM to child if parent exits
-            if (n == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
 
-            if (getppid() != ppid) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+int read_user(char *uid, user_record *rec) {  // copy user's record; 0 if user never registered
+    user_slot *slot = &store->slots[atoi(uid)];
+    int cur = current_copy(slot);
 
-            /* close accept socket; swap new and accept socket */
-            close(fd_tcp);
-            fd_tcp = newfd;
+    if (cur == -1 || !(slot->copy[cur].flags & USER_EXISTS)) return 0;
 
-            /* store client ip and port */
-            strcpy(cip, inet_ntoa(addr_tcp.sin_addr));
-            cport = ntohs(addr_tcp.sin_port);
+    *rec = slot->copy[cur];
+    return 1;
+}
 
-            while (1) {
-                bzero(buffer, 6);
-                bzero(rcode, 4);
-                if ((n = read(fd_tcp, buffer, 4)) > 0)
-                    strncpy(rcode, buffer, 4);  // read request code + space
 
-                if (n <= 0) break;
+void write_user(char *uid, user_record *rec, int sync) {  // crash-safe update; caller holds user lock
+    user_slot *slot = &store->slots[atoi(uid)];
+    int cur = current_copy(slot), next = (cur == 0);  // overwrite the older (or torn) copy
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start;
 
-                /* perform operation acording to rcode; error if invalid */
-                if (strcmp(rcode, "LOG ") == 0) login_user();
-                else if (strcmp(rcode, "REQ ") == 0) request_operation();
-                else if (strcmp(rcode, "AUT ") == 0) authenticate_operation();
-                else protocol_error_tcp();
-            }
+    rec->gen = cur == -1 ? 1 : slot->copy[cur].gen + 1;
+    rec->sum = record_sum(rec);
 
-            if (strcmp(cuid, "") != 0) {  // user logged in
-                chdir(cuid);
+    /* a torn write leaves a bad sum; readers then keep using the old copy */
+    slot->copy[next] = *rec;
 
-                if (verbose_mode) fprintf(stdout, "%s: logout (IP: %s | PORT: %d)\n", cuid, cip, cport);
+    if (sync) {
+        start = (uintptr_t) &slot->copy[next] & ~(uintptr_t) (page - 1);
+        msync((void*) start, page, MS_SYNC);
+    }
+}
 
-                remove("login.txt");
 
-                chdir("..");
-            }
+int import_user(char *uid) {  // copy USERS/<uid>/pass.txt and reg.txt into the store; 0 if no pass
+    char path[32], pdip[18], pdport[8];
+    user_record rec;
+    FILE *passfile, *reg;
 
-            disconnect_tcpserver();  // disconnects tcp sub-server
+    sprintf(path, "%s/pass.txt", uid);
+    if (!(passfile = fopen(path, "r"))) return 0;
 
-            exit(0);  // child exits if successful
+    memset(&rec, 0, sizeof(rec));
+    if (fscanf(passfile, "%8c", rec.pass) == 1) rec.flags = USER_EXISTS;
+    fclose(passfile);
 
+    if (!rec.flags) return 0;
+
+    sprintf(path, "%s/reg.txt", uid);
+    if ((reg = fopen(path, "r"))) {
+        if (fscanf(reg, "%17s %7s", pdip, pdport) == 2 && inet_pton(AF_INET, pdip, &rec.pdaddr) == 1) {
+            rec.pdport = htons(atoi(pdport));
+            rec.flags |= USER_REGISTERED;
+        }
+
+        fclose(reg);
+    }
+
+    write_user(uid, &rec, 0);  // synced once the scan is done
+
+    return 1;
+}
+
+
+void *scan_users(void *arg) {  // one startup thread: its share of user dirs, then its share of the store
+    scan_job *job = arg;
+    user_session *u;
+    user_record rec;
+    char uid[12], path[32];
+    int i;
+
+    for (i = 0; i < job->ndirs; i++) {
+        sprintf(uid, "%05d", job->dirs[i]);
+
+        /* sessions do not survive a restart; tids only when restore_state() brings them back */
+        sprintf(path, "%s/login.txt", uid);
+        if (unlink(path) == 0) job->purged++;
+
+        sprintf(path, "%s/tid.txt", uid);
+        if ((replica || !snap_interval) && unlink(path) == 0) job->purged++;
+
+        if (store_created) job->imported += import_user(uid);
+    }
+
+    /* pd endpoint cache; REQ then sends vcs without reading the store */
+    for (i = job->first; i < job->last; i++) {
+        sprintf(uid, "%05d", i);
+        if (!read_user(uid, &rec) || !(rec.flags & USER_REGISTERED)) continue;
+
+        u = get_user(uid);
+        u->pd.sin_family = AF_INET;
+        u->pd.sin_addr.s_addr = rec.pdaddr;
+        u->pd.sin_port = rec.pdport;
+        job->cached++;
+    }
+
+    return NULL;
+}
+
+
+void scan_store() {  // startup: purge stale files, import on first run and fill caches, in parallel
+    scan_job jobs[WORKERS_MAX];
+    struct dirent *entry;
+    long long start = now_ms();
+    int *dirs, ndirs = 0, njobs, j, purged = 0, imported = 0, cached = 0;
+    DIR *udir;
+
+    /* user dirs, by uid; listing is cheap, the files in them are not */
+    if (!(dirs = malloc(MAX_USERS * sizeof(int)))) { fputs("Error: Could not scan users. Exiting...\n", stderr); exit(1); }
+
+    if ((udir = opendir("."))) {
+        while ((entry = readdir(udir)) != NULL && ndirs < MAX_USERS)
+            if (strlen(entry->d_name) == 5 && is_only(NUMERIC, entry->d_name)) dirs[ndirs++] = atoi(entry->d_name);
+
+        closedir(udir);
+    }
+
+    njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (njobs < 1) njobs = 1;
+    if (njobs > WORKERS_MAX) njobs = WORKERS_MAX;
+
+    for (j = 0; j < njobs; j++) {
+        memset(&jobs[j], 0, sizeof(scan_job));
+
+        jobs[j].dirs = dirs + (long) ndirs * j / njobs;
+        jobs[j].ndirs = (long) ndirs * (j + 1) / njobs - (long) ndirs * j / njobs;
+        jobs[j].first = (long) MAX_USERS * j / njobs;
+        jobs[j].last = (long) MAX_USERS * (j + 1) / njobs;
+
+        if (pthread_create(&jobs[j].thread, NULL, scan_users, &jobs[j]) != 0) {
+            fputs("Error: Could not scan users. Exiting...\n", stderr); exit(1); }
+    }
+
+    for (j = 0; j < njobs; j++) {
+        pthread_join(jobs[j].thread, NULL);
+
+        purged += jobs[j].purged; imported += jobs[j].imported; cached += jobs[j].cached;
+    }
+
+    free(dirs);
+
+    if (store_created) {
+        store->magic = STORE_MAGIC;
+        msync(store, sizeof(user_store), MS_SYNC);  // one flush for the whole import
+    }
+
+    fprintf(stdout, "AS: started in %lld ms (%d user dirs, %d imported, %d stale files removed, %d pds cached, %d threads)\n",
+            now_ms() - start, ndirs, imported, purged, cached, njobs);
+
+    fflush(stdout);  // not yet unbuffered; avoid a second copy after fork
+}
+
+
+void setup_store() {  // map credential store; created on first run and filled by scan_store()
+    struct stat st;
+    int fd;
+
+    fd = open(STORE_FILE, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || fstat(fd, &st) == -1) { fputs("Error: Could not open user store. Exiting...\n", stderr); exit(1); }
+
+    store_created = st.st_size == 0;
+
+    if (store_created && ftruncate(fd, sizeof(user_store)) == -1) {
+        fputs("Error: Could not create user store. Exiting...\n", stderr); exit(1); }
+
+    else if (!store_created && st.st_size != sizeof(user_store)) {
+        fputs("Error: User store has unexpected size. Exiting...\n", stderr); exit(1); }
+
+    store = mmap(NULL, sizeof(user_store), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (store == MAP_FAILED) { fputs("Error: Could not map user store. Exiting...\n", stderr); exit(1); }
+
+    close(fd);  // mapping stays valid
+
+    if (!store_created && store->magic == 0) store_created = 1;  // import was cut short; redo it
+    else if (!store_created && store->magic != STORE_MAGIC) { fputs("Error: Invalid user store. Exiting...\n", stderr); exit(1); }
+}
+
+
+void lock_user(char *uid) { pthread_mutex_lock(&shared->locks[atoi(uid) % LOCK_STRIPES]); }
+
+
+void unlock_user(char *uid) { pthread_mutex_unlock(&shared->locks[atoi(uid) % LOCK_STRIPES]); }
+
+
+int register_record(char *uid, char *pass, char *pdip, char *pdport, int sync) {  // create or update user; 0 if pass differs
+    user_session *u = get_user(uid);
+    user_record rec;
+    int ok = 0;
+
+    lock_user(uid);
+
+    /* if pass is different, reg nok; new users are created with this pass */
+    if (!read_user(uid, &rec) || memcmp(rec.pass, pass, 8) == 0) {
+        memcpy(rec.pass, pass, 8);
+        inet_pton(AF_INET, pdip, &rec.pdaddr);
+        rec.pdport = htons(atoi(pdport));
+        rec.flags = USER_EXISTS | USER_REGISTERED;
+
+        write_user(uid, &rec, sync);
+        repl_user(uid, &rec);
+
+        /* pd endpoint cache; REQ sends vcs here without resolving */
+        u->pd.sin_family = AF_INET;
+        u->pd.sin_addr.s_addr = rec.pdaddr;
+        u->pd.sin_port = rec.pdport;
+        memset(&u->health, 0, sizeof(pd_health));  // new pd, clean slate
+
+        ok = 1;
+    }
+
+    unlock_user(uid);
+
+    return ok;
+}
+
+
+void register_user(udp_worker *w) {  // register a user
+    char response[128];
+    char uid[8], pass[10], pdip[18], pdport[8];
+
+    bzero(uid, 8); bzero(pass, 10); bzero(pdip, 18); bzero(pdport, 8);
+    sscanf(w->buffer, "%*s %7s %9s %17s %7s", uid, pass, pdip, pdport);
+
+    if (verbose_mode) fprintf(stdout, "%s: register (IP: %s | PORT: %d)\n", uid, w->cip, w->cport);
+
+    if (replica) strcpy(response, "RRG NOK\n");  // read-only; register with the primary
+
+    else if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
+        !is_only(ALPHANUMERIC, pass) || !is_only(IP, pdip) || strlen(pdport) == 0 ||
+        strlen(pdport) > 5 || !is_only(NUMERIC, pdport) || atoi(pdport) > 65535)
+        strcpy(response, "RRG NOK\n");
+
+    else if (redirect(uid, "RRG", "NOK", response));  // another shard's user
+
+    else if (register_record(uid, pass, pdip, pdport, 1)) strcpy(response, "RRG OK\n");
+    else strcpy(response, "RRG NOK\n");
+
+    reply_udp(w, response);  // queued; sent with the rest of the batch
+}
+
+
+void unregister_user(udp_worker *w) {
+    char response[128];
+    char uid[8], pass[10];
+    user_record rec;
+
+    bzero(uid, 8); bzero(pass, 10);
+    sscanf(w->buffer, "%*s %7s %9s", uid, pass);
+
+    if (verbose_mode) fprintf(stdout, "%s: unregister (IP: %s | PORT: %d)\n", uid, w->cip, w->cport);
+
+    if (replica) strcpy(response, "RUN NOK\n");  // read-only
+
+    else if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
+        !is_only(ALPHANUMERIC, pass))
+        strcpy(response, "RUN NOK\n");
+
+    else if (redirect(uid, "RUN", "NOK", response));  // another shard's user
+
+    else {
+        lock_user(uid);
+
+        /* user not found, wrong pass or pd already removed */
+        if (!read_user(uid, &rec) || memcmp(rec.pass, pass, 8) != 0 || !(rec.flags & USER_REGISTERED))
+            strcpy(response, "RUN NOK\n");
+
+        else {
+            /* remove pd info */
+            rec.flags &= ~USER_REGISTERED;
+            write_user(uid, &rec, 1);
+            repl_user(uid, &rec);
+
+            memset(&get_user(uid)->pd, 0, sizeof(struct sockaddr_in));
+            memset(&get_user(uid)->health, 0, sizeof(pd_health));
+
+            strcpy(response, "RUN OK\n");
+        }
+
+        unlock_user(uid);
+    }
+
+    reply_udp(w, response);  // queued; sent with the rest of the batch
+}
+
+
+void check_tid(char *uid, char *tid, char *response) {  // CNF line for uid's tid; memory lookup only
+    char prefix[16];
+    op_slot *o;
+
+    /* fs used a stale shard map */
+    sprintf(prefix, "CNF %s %s", uid, tid);
+    if (redirect(uid, prefix, "E", response)) return;
+
+    lock_user(uid);
+
+    /* any live tid of the user */
+    if (atoi(tid) == 0 || !(o = find_op(get_user(uid), 0, atoi(tid)))) sprintf(response, "CNF %s %s E\n", uid, tid);  // invalid tid
+    else if (o->op == 'R' || o->op == 'U' || o->op == 'D') sprintf(response, "CNF %s %s %c %s\n", uid, tid, o->op, o->fname);
+    else if (o->op == 'L' || o->op == 'X') sprintf(response, "CNF %s %s %c\n", uid, tid, o->op);
+    else sprintf(response, "CNF %s %s E\n", uid, tid);  // unknown op
+
+    unlock_user(uid);
+}
+
+
+void validate_operation(udp_worker *w) {
+    char response[128];
+    char uid[8], tid[6];
+
+    bzero(uid, 8); bzero(tid, 6);
+    sscanf(w->buffer, "%*s %7s %5s", uid, tid);
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(tid) != 4 ||
+        !is_only(NUMERIC, tid)) {
+        protocol_error_udp(w); return; }
+
+    if (verbose_mode) fprintf(stdout, "FS: validate %s (IP: %s | PORT: %d)\n", tid, w->cip, w->cport);
+
+    check_tid(uid, tid, response);
+
+    reply_udp(w, response);  // queued; sent with the rest of the batch
+}
+
+
+void validate_batch(udp_worker *w) {  // "VLB k uid tid ..."; answered "CNB k\n" and one CNF line per entry, in order
+    char response[UDP_BUF], *p = w->buffer + 4;
+    char uid[8], tid[6];
+    int k = 0, i, used, len;
+
+    if (sscanf(p, "%d%n", &k, &used) != 1 || k < 1 || k > VLB_MAX) { protocol_error_udp(w); return; }
+    p += used;
+
+    if (verbose_mode) fprintf(stdout, "FS: validate %d tids (IP: %s | PORT: %d)\n", k, w->cip, w->cport);
+
+    used = sprintf(response, "CNB %d\n", k);
+
+    for (i = 0; i < k; i++) {
+        bzero(uid, 8); bzero(tid, 6);
+
+        /* one bad entry spoils the datagram, as with VLD */
+        if (sscanf(p, " %7s %5s%n", uid, tid, &len) != 2 || strlen(uid) != 5 || !is_only(NUMERIC, uid) ||
+            strlen(tid) != 4 || !is_only(NUMERIC, tid)) {
+            protocol_error_udp(w); return; }
+
+        p += len;
+
+        check_tid(uid, tid, response + used);
+        used += strlen(response + used);
+    }
+
+    reply_udp(w, response);  // queued; sent with the rest of the batch
+}
+
+
+long long replica_lag(uint64_t *behind) {  // records and ms this replica trails its primary by
+    *behind = primary_seq > applied_seq ? primary_seq - applied_seq : 0;
+
+    if (repl_connected && follow_epoch && !*behind) return 0;
+    return now_ms() - synced_at;
+}
+
+
+void report_lag(udp_worker *w) {  // "LAG"; answered "RLG records ms", "RLG 0 0" by a primary
+    char response[64];
+    uint64_t behind = 0;
+    long long lag = 0;
+
+    if (replica) lag = replica_lag(&behind);
+
+    sprintf(response, "RLG %llu %lld\n", (unsigned long long) behind, lag);
+
+    reply_udp(w, response);  // queued; sent with the rest of the batch
+}
+
+
+void report_stats(udp_worker *w) {  // "STA"; "RST uptime" then one line per opcode seen and one for admission
+    char response[STA_BUF];
+    op_stats sum;
+    thread_stats *st;
+    unsigned long priority = 0, shed_source = 0, shed_global = 0, hits = 0, misses = 0;
+    long long now = now_ms();
+    int len, op, t, i, code, live = 0, caches = 0;
+
+    len = sprintf(response, "RST %lld\n", (now_us() - started_at) / 1000000);
+
+    for (op = 0; op < STAT_OPS; op++) {
+        memset(&sum, 0, sizeof(op_stats));
+
+        /* unlocked reads of counters other threads own; a line may be a few requests stale */
+        for (t = 0; t < 2 * WORKERS_MAX; t++) {
+            if (t < WORKERS_MAX ? t >= nworkers : t - WORKERS_MAX >= ntcpworkers) continue;
+            st = &shared->stats[t];
+
+            sum.count += st->ops[op].count;
+            for (code = 0; code < STAT_CODES; code++) sum.codes[code] += st->ops[op].codes[code];
+            for (i = 0; i < HIST_BUCKETS; i++) sum.hist[i] += st->ops[op].hist[i];
+            if (st->ops[op].max > sum.max) sum.max = st->ops[op].max;
+        }
+
+        if (!sum.count) continue;
+
+        len += sprintf(response + len, "%s n %lu", stat_names[op], sum.count);
+
+        for (code = 0; code < STAT_CODES; code++)
+            if (sum.codes[code]) len += sprintf(response + len, " %s %lu", code_names[code], sum.codes[code]);
+
+        len += sprintf(response + len, " p50 %lld p90 %lld p99 %lld p999 %lld max %lld\n", percentile(&sum, 0.5),
+                       percentile(&sum, 0.9), percentile(&sum, 0.99), percentile(&sum, 0.999), sum.max);
+    }
+
+    for (t = 0; t < nworkers; t++) {
+        priority += workers[t].priority; shed_source += workers[t].shed_source; shed_global += workers[t].shed_global; }
+
+    len += sprintf(response + len, "ADM priority %lu shed_source %lu shed_global %lu\n", priority, shed_source, shed_global);
+
+    /* other workers' caches are read unlocked; live is approximate */
+    for (t = 0; t < nworkers; t++) {
+        hits += workers[t].reply_hits; misses += workers[t].reply_misses;
+        if (!workers[t].replies) continue;
+
+        caches++;
+        for (i = 0; i < REPLY_CACHE; i++) live += workers[t].replies[i].expires > now;
+    }
+
+    len += sprintf(response + len, "RPC hits %lu misses %lu live %d bytes %lu\n",
+                   hits, misses, live, (unsigned long) caches * REPLY_CACHE * sizeof(reply_entry));
+
+    /* too long for the batched reply buffers; sent on its own */
+    sendto(w->fd, response, len, 0, (struct sockaddr*) &w->addr, w->addrlen);
+}
+
+
+int get_pd(char *uid, struct sockaddr_in *pd) {  // user's pd endpoint and breaker state; -1 if not registered
+    user_session *u = get_user(uid);
+    user_record rec;
+    int state = -1;
+
+    lock_user(uid);
+
+    /* cache filled by REG and dropped by UNR; rebuilt from the store after a restart */
+    if (u->pd.sin_family != AF_INET && read_user(uid, &rec) && (rec.flags & USER_REGISTERED)) {
+        u->pd.sin_family = AF_INET;
+        u->pd.sin_addr.s_addr = rec.pdaddr;
+        u->pd.sin_port = rec.pdport;
+    }
+
+    if (u->pd.sin_family == AF_INET) { *pd = u->pd; state = u->health.state; }
+
+    unlock_user(uid);
+
+    return state;
+}
+
+
+void link_delivery(tcp_worker *w, vc_delivery *d) {  // add to worker's in-flight list and uid hash
+    int bucket = atoi(d->key) % DELIVERY_BUCKETS;
+
+    d->w = w;
+
+    d->next = w->deliveries;
+    if (d->next) d->next->prev = d;
+    w->deliveries = d;
+
+    d->hnext = w->by_uid[bucket];
+    w->by_uid[bucket] = d;
+}
+
+
+int send_vc(tcp_session *s, char *uid, int rid, char op, char *fname, char *error) {  // start vc delivery; error set if failed
+    vc_delivery *d, *old;
+    int state;
+
+    if (!(d = calloc(1, sizeof(vc_delivery)))) { strcpy(error, "RRQ EPD\n"); return 0; }
+
+    if ((state = get_pd(uid, &d->pd)) != PD_CLOSED) {
+        /* not registered, or pd failing: answer now instead of waiting out the deadline */
+        if (state != -1) __sync_fetch_and_add(&shared->fast_fails, 1);
+
+        free(d); strcpy(error, "RRQ EPD\n"); return 0;
+    }
+
+    /* pd replies carry no vc; one delivery per uid and pd, so a late RVC cannot answer the newer one */
+    while ((old = find_delivery(s->worker, uid, &d->pd))) {
+        old->cancelled = 1;
+        finish_vc(old, "RRQ ERR\n");
+    }
+
+    d->s = s;
+    strcpy(d->key, uid);
+    strcpy(d->uid, uid);
+    d->vc = generate_vc();
+    d->rid = rid;
+    d->op = op;
+    strcpy(d->fname, fname);
+
+    /* check if operation involves fname */
+    if (strcmp(fname, "") == 0) sprintf(d->request, "VLC %s %d %c\n", uid, d->vc, op);
+    else sprintf(d->request, "VLC %s %d %c %s\n", uid, d->vc, op, fname);
+
+    /* first try now; check_deliveries() retransmits with backoff until deadline */
+    sendto(s->worker->fd_udp, d->request, strlen(d->request), 0, (struct sockaddr*) &d->pd, sizeof(d->pd));
+
+    d->attempts = 1;
+    d->rto = VC_TIMEOUT_INIT;
+    d->started = now_us();
+    d->sent = now_ms();
+    d->next_try = d->sent + d->rto;
+    d->deadline = d->sent + VC_DEADLINE;
+
+    link_delivery(s->worker, d);
+
+    s->delivery = d;  // session waits for it
+
+    return 1;
+}
+
+
+void start_probe(tcp_worker *w, char *uid, struct sockaddr_in *pd, int delay) {  // background vc to a failing pd
+    vc_delivery *d;
+
+    if (!(d = calloc(1, sizeof(vc_delivery)))) return;  // breaker stays open until REG
+
+    d->pd = *pd;
+    strcpy(d->key, PROBE_UID);
+    strcpy(d->uid, uid);
+    sprintf(d->request, "VLC %s 0000 L\n", PROBE_UID);
+
+    /* first send when cooldown ends (attempts 0); see check_deliveries() */
+    d->rto = VC_TIMEOUT_INIT;
+    d->next_try = now_ms() + delay;
+    d->deadline = d->next_try + VC_DEADLINE;
+
+    link_delivery(w, d);
+}
+
+
+int pd_outcome(vc_delivery *d, int ok) {  // update pd breaker; returns probe delay if one is due, else 0
+    user_session *u = get_user(d->uid);
+    pd_health *h = &u->health;
+    int rtt, probe = 0;
+
+    lock_user(d->uid);
+
+    /* pd re-registered (or removed) while in flight; not its health */
+    if (u->pd.sin_addr.s_addr != d->pd.sin_addr.s_addr || u->pd.sin_port != d->pd.sin_port) {
+        unlock_user(d->uid); return 0; }
+
+    if (ok) {
+        h->ok++;
+        h->fails = 0;
+
+        /* karn: only unambiguous samples */
+        if (d->attempts == 1) {
+            rtt = now_ms() - d->sent;
+            h->srtt = h->srtt ? (7 * h->srtt + rtt) / 8 : rtt + 1;
+        }
+
+        if (h->state != PD_CLOSED) {
+            h->state = PD_CLOSED;
+            h->cooldown = 0;
+            __sync_fetch_and_add(&shared->recoveries, 1);
+
+            if (verbose_mode) fprintf(stdout, "%s: PD breaker closed\n", d->uid);
+        }
+    }
+
+    else {
+        h->failed++;
+        h->fails++;
+
+        /* trip after repeated failures; a failed probe reopens with longer cooldown */
+        if (h->state == PD_CLOSED && h->fails >= BREAKER_FAILS) {
+            h->state = PD_OPEN;
+            probe = h->cooldown = BREAKER_COOLDOWN;
+            __sync_fetch_and_add(&shared->trips, 1);
+
+            if (verbose_mode) fprintf(stdout, "%s: PD breaker open (%d fails)\n", d->uid, h->fails);
+        }
+
+        else if (!d->s && h->state != PD_CLOSED) {
+            h->state = PD_OPEN;
+            h->cooldown = h->cooldown * 2 > BREAKER_COOLDOWN_MAX ? BREAKER_COOLDOWN_MAX : h->cooldown * 2;
+            probe = h->cooldown;
+        }
+    }
+
+    unlock_user(d->uid);
+
+    return probe;
+}
+
+
+void unlink_delivery(vc_delivery *d) {  // remove from worker list and hash, and free
+    tcp_worker *w = d->w;
+    vc_delivery **pp;
+
+    if (d->prev) d->prev->next = d->next;
+    else w->deliveries = d->next;
+    if (d->next) d->next->prev = d->prev;
+
+    for (pp = &w->by_uid[atoi(d->key) % DELIVERY_BUCKETS]; *pp; pp = &(*pp)->hnext)
+        if (*pp == d) { *pp = d->hnext; break; }
+
+    if (d->s) d->s->delivery = NULL;
+
+    free(d);
+}
+
+
+vc_delivery *find_delivery(tcp_worker *w, char *uid, struct sockaddr_in *from) {  // in-flight vc sent to from
+    vc_delivery *d;
+
+    for (d = w->by_uid[atoi(uid) % DELIVERY_BUCKETS]; d; d = d->hnext)
+        if (strcmp(d->key, uid) == 0 && d->pd.sin_addr.s_addr == from->sin_addr.s_addr &&
+            d->pd.sin_port == from->sin_port) return d;
+
+    return NULL;
+}
+
+
+void finish_vc(vc_delivery *d, char *response) {  // answer REQ (or end probe); resume session's queued requests
+    tcp_session *s = d->s;
+    op_slot *o;
+    int probe;
+
+    if (d->started) count_op(d->w->stats, STAT_PD, response, d->started);  // pd wait, retransmits included
+
+    /* any answer, even NOK, means the pd is alive; EPD means it never answered */
+    if (!d->cancelled && (probe = pd_outcome(d, strcmp(response, "RRQ EPD\n") != 0))) start_probe(d->w, d->uid, &d->pd, probe);
+
+    if (s && strcmp(response, "RRQ OK\n") == 0) {
+        lock_user(d->uid);
+
+        /* save op info; a REQ repeating a pending rid replaces its vc */
+        if ((o = find_op(get_user(d->uid), d->rid, 0)) || (o = new_op(d->uid))) {
+            o->rid = d->rid;
+            o->vc = d->vc;
+            o->op = d->op;
+            strcpy(o->fname, d->fname);
+            arm_expiry(o, vc_ttl);
+            repl_op(REPL_VC, d->uid, o);
+        }
+
+        else response = "RRQ ERR\n";  // another session of the user took the last slot
+
+        unlock_user(d->uid);
+    }
+
+    unlink_delivery(d);
+
+    if (!s) return;  // probe
+
+    write_tcp(s, response);
+
+    process_requests(s);
+    hold_input(s);  // buffer may have room again
+
+    if (s->closing) drop_session(s);  // its events may still be in the worker's batch
+}
+
+
+void fail_unreachable(tcp_worker *w) {  // drain icmp errors; fail vcs sent to those pds
+    char data[1], control[512];
+    struct sockaddr_in to;
+    struct iovec iov;
+    struct msghdr msg;
+    vc_delivery *d, *next;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        msg.msg_name = &to;  // original destination, i.e. the pd
+        msg.msg_namelen = sizeof(to);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(w->fd_udp, &msg, MSG_ERRQUEUE) == -1) return;
+
+        for (d = w->deliveries; d; d = next) {
+            next = d->next;
+
+            /* probes still in cooldown have not been refused yet */
+            if (d->pd.sin_addr.s_addr == to.sin_addr.s_addr && d->pd.sin_port == to.sin_port && d->attempts)
+                finish_vc(d, "RRQ EPD\n");
+        }
+    }
+}
+
+
+void receive_vc(tcp_worker *w) {  // pds answered (or refused) vcs; match replies by uid
+    char response[128], ruid[8], status[5];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    vc_delivery *d;
+    ssize_t len;
+
+    while (1) {
+        fromlen = sizeof(from);
+        len = recvfrom(w->fd_udp, response, 127, 0, (struct sockaddr*) &from, &fromlen);
+
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (len == -1) { fail_unreachable(w); continue; }  // pd port closed (icmp)
+
+        response[len] = '\0';
+
+        bzero(ruid, 8); bzero(status, 5);
+        sscanf(response, "%*s %7s %4s", ruid, status);
+
+        if (strcmp(response, "ERR\n") == 0) strcpy(ruid, PROBE_UID);  // only probes are malformed on purpose
+
+        if (!(d = find_delivery(w, ruid, &from))) continue;  // late retransmit answer or stray datagram
+
+        if (strcmp(status, "OK") != 0) finish_vc(d, "RRQ EUSER\n");
+        else finish_vc(d, "RRQ OK\n");
+    }
+}
+
+
+int check_deliveries(tcp_worker *w) {  // retransmit or expire vcs; ms until next timer, -1 if none
+    vc_delivery *d, *next;
+    long long now = now_ms(), wait, timer = -1;
+
+    for (d = w->deliveries; d; d = next) {
+        next = d->next;
+
+        if (now >= d->deadline) { finish_vc(d, "RRQ EPD\n"); continue; }
+
+        if (now >= d->next_try) {
+            if (!d->attempts) {  // probe's cooldown is over
+                lock_user(d->uid);
+                if (get_user(d->uid)->health.state == PD_OPEN) get_user(d->uid)->health.state = PD_PROBING;
+                unlock_user(d->uid);
+
+                __sync_fetch_and_add(&shared->probes, 1);
+                d->sent = now;
+            }
+
+            sendto(w->fd_udp, d->request, strlen(d->request), 0, (struct sockaddr*) &d->pd, sizeof(d->pd));
+
+            if (d->attempts++) d->rto *= 2;  // exponential backoff
+            d->next_try = now + d->rto;
+        }
+
+        wait = (d->next_try < d->deadline ? d->next_try : d->deadline) - now;
+        if (timer == -1 || wait < timer) timer = wait;
+    }
+
+    return timer;
+}
+
+
+void bulk_register(tcp_session *s, char *request) {  // "BRG k"; k record lines follow, answered together
+    int k = -1;
+
+    sscanf(request, "%d", &k);
+
+    /* provisioning is for local admins only */
+    if (strcmp(s->cip, "127.0.0.1") != 0 || k < 1 || k > BULK_MAX) { write_tcp(s, "RBR ERR\n"); return; }
+
+    if (!(s->bulk_out = malloc(16 + k * BULK_LINE))) { write_tcp(s, "RBR ERR\n"); return; }
+
+    if (verbose_mode) fprintf(stdout, "AS: bulk register %d users (IP: %s | PORT: %d)\n", k, s->cip, s->cport);
+
+    s->bulk_left = s->bulk_count = k;
+    s->bulk_len = sprintf(s->bulk_out, "RBR %d\n", k);
+    s->bulk_lo = MAX_USERS;
+    s->bulk_hi = -1;
+}
+
+
+void bulk_record(tcp_session *s, char *line) {  // "uid pass pdip pdport" of a BRG batch; "uid OK|NOK|ERR|RDR ..." each
+    char uid[8], pass[10], pdip[18], pdport[8], result[BULK_LINE];
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start, end;
+
+    bzero(uid, 8); bzero(pass, 10); bzero(pdip, 18); bzero(pdport, 8);
+    sscanf(line, "%7s %9s %17s %7s", uid, pass, pdip, pdport);
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid)) strcpy(result, "ERR\n");
+
+    else if (strlen(pass) != 8 || !is_only(ALPHANUMERIC, pass) || !is_only(IP, pdip) ||
+        strlen(pdport) == 0 || strlen(pdport) > 5 || !is_only(NUMERIC, pdport) || atoi(pdport) > 65535 || replica)
+        sprintf(result, "%s NOK\n", uid);
+
+    else if (redirect(uid, uid, "NOK", result));  // another shard's user
+
+    else {
+        /* unsynced; the batch is flushed at once below */
+        if (register_record(uid, pass, pdip, pdport, 0)) sprintf(result, "%s OK\n", uid);
+        else sprintf(result, "%s NOK\n", uid);
+
+        if (atoi(uid) < s->bulk_lo) s->bulk_lo = atoi(uid);
+        if (atoi(uid) > s->bulk_hi) s->bulk_hi = atoi(uid);
+    }
+
+    strcpy(s->bulk_out + s->bulk_len, result);
+    s->bulk_len += strlen(result);
+
+    if (--s->bulk_left) return;
+
+    /* one durable write for the whole batch; results only go out after it */
+    if (s->bulk_hi >= 0) {
+        start = (uintptr_t) &store->slots[s->bulk_lo] & ~(uintptr_t) (page - 1);
+        end = (uintptr_t) &store->slots[s->bulk_hi + 1];
+        msync((void*) start, end - start, MS_SYNC);
+    }
+
+    write_tcp(s, s->bulk_out);
+
+    free(s->bulk_out);
+    s->bulk_out = NULL;
+}
+
+
+void login_user(tcp_session *s, char *request) {
+    char response[128], path[32];
+    char uid[8], pass[10];
+    user_record rec;
+    FILE *login;
+
+    bzero(uid, 8); bzero(pass, 10);
+    sscanf(request, "%7s %9s", uid, pass);
+
+    if (verbose_mode) fprintf(stdout, "%s: login (IP: %s | PORT: %d)\n", uid, s->cip, s->cport);
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(pass) != 8 ||
+        !is_only(ALPHANUMERIC, pass))
+        strcpy(response, "RLO ERR\n");
+
+    else {
+        if (redirect(uid, "RLO", "ERR", response)) { write_tcp(s, response); return; }  // another shard's user
+
+        lock_user(uid);
+
+        if (!read_user(uid, &rec)) strcpy(response, "RLO ERR\n");  // user does not exist
+        else if (memcmp(rec.pass, pass, 8) != 0) strcpy(response, "RLO NOK\n");  // wrong pass
+        else strcpy(response, "RLO OK\n");
+
+        unlock_user(uid);
+
+        if (strcmp(response, "RLO OK\n") == 0) {
+            if (strcmp(s->cuid, "") != 0) logout_user(s);  // relogin on same session
+
+            lock_user(uid);
+
+            get_user(uid)->logins++;
+            repl_login(uid, get_user(uid));
+
+            if (persist_mode) {
+                sprintf(path, "%s/login.txt", uid);
+                mkdir(uid, 0755);  // users registered through the store have no dir yet
+
+                login = fopen(path, "w");  // create temp login file
+                if (login) fclose(login);
+            }
+
+            unlock_user(uid);
+
+            strcpy(s->cuid, uid);
+        }
+    }
+
+    write_tcp(s, response);
+}
+
+
+int op_room(char *uid, int rid) {  // can user take one more operation (or reuse rid)
+    user_session *u = get_user(uid);
+    int room;
+
+    lock_user(uid);
+    room = u->nops < max_ops || find_op(u, rid, 0);
+    unlock_user(uid);
+
+    return room;
+}
+
+
+void request_operation(tcp_session *s, char *request) {
+    char response[128];
+    char uid[8], op[3], fname[32];
+    int rid = -1;
+
+    bzero(uid, 8); bzero(op, 3); bzero(fname, 32);
+    sscanf(request, "%7s %d %2s %31s", uid, &rid, op, fname);
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || rid < 0 || rid > 9999)
+        strcpy(response, "RRQ ERR\n");
+
+    else if (!is_only(OP, op)) strcpy(response, "RRQ EFOP\n");
+
+    else if (strchr("RUD", op[0]) && !is_only(FILENAME, fname)) strcpy(response, "RRQ ERR\n");
+
+    else {
+        if (strchr("LX", op[0])) strcpy(fname, "");  // operation does not involve fname
+
+        if (verbose_mode) {
+            if (strlen(fname)) fprintf(stdout, "%s: request - %c %s (IP: %s | PORT: %d)\n", uid, op[0], fname, s->cip, s->cport);
+            else fprintf(stdout, "%s: request - %c (IP: %s | PORT: %d)\n", uid, op[0], s->cip, s->cport);
+        }
+
+        if (strcmp(s->cuid, "") == 0) strcpy(response, "RRQ ELOG\n");  // no user logged in
+        else if (strcmp(s->cuid, uid) != 0) strcpy(response, "RRQ EUSER\n");  // other user logged in
+        else if (!op_room(uid, rid)) strcpy(response, "RRQ ERR\n");  // too many operations in flight
+        else if (send_vc(s, uid, rid, op[0], fname, response)) return;  // answered by finish_vc()
+    }
+
+    write_tcp(s, response);
+}
+
+
+void read_key(char *path) {  // load token key; same file as the fss' -k
+    FILE *keyfile = fopen(path, "r");
+
+    if (!keyfile) { fputs("Error: Could not read key file. Exiting...\n", stderr); exit(1); }
+
+    token_keylen = fread(token_key, 1, KEY_MAX, keyfile);
+    fclose(keyfile);
+
+    if (token_keylen < 16) { fputs("Error: Key must be at least 16 bytes. Exiting...\n", stderr); exit(1); }
+}
+
+
+void token_mac(char *uid, char op, unsigned exp, unsigned nonce, char *fname, char *mac) {  // 16 hex of hmac-sha256
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    sprintf(msg, "%s %c %08x %04x %s", uid, op, exp, nonce, fname);
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+
+void push_mac(char *uid, int tid, char op, unsigned exp, char *fname, char *mac) {  // 16 hex of hmac-sha256 over a TID push
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    sprintf(msg, "TID %s %d %c %08x %s", uid, tid, op, exp, fname);  // prefixed; never equal to a token's message
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+
+void make_token(char *uid, op_slot *o, char *token) {  // self-verifying tid; fss check it with the key alone
+    char mac[17];
+    unsigned exp = tid_ttl ? time(NULL) + tid_ttl : 0, nonce = random_u16();  // wall clock; fss compare against theirs
+
+    token_mac(uid, o->op, exp, nonce, o->fname, mac);
+    sprintf(token, "%c%08x%04x%s%s", o->op, exp, nonce, mac, o->fname);
+}
+
+
+void push_tid(tcp_worker *w, char *push) {  // best effort; a lost push costs the fs one VLD
+    int i;
+
+    for (i = 0; i < nfs; i++)
+        sendto(w->fd_udp, push, strlen(push), 0, (struct sockaddr*) &fs_push[i], sizeof(fs_push[i]));
+}
+
+
+void authenticate_operation(tcp_session *s, char *request) {
+    char response[128], push[80], token[TOKEN_FIXED + 26], mac[17];
+    unsigned exp;
+    char uid[8], mode[3];
+    int rvc = -1, rrid = -1, tid, issued = 0;  // issued: classic tid, pushed to fss
+    user_session *u;
+    op_slot *o;
+
+    bzero(uid, 8); bzero(mode, 3);
+    sscanf(request, "%7s %d %d %2s", uid, &rrid, &rvc, mode);
+
+    if (verbose_mode) fprintf(stdout, "%s: authenticate - %d (IP: %s | PORT: %d)\n", uid, rvc, s->cip, s->cport);
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || rrid < 0 ||
+        rrid > 9999 || rvc < 0 || rvc > 9999 ||
+        strcmp(s->cuid, uid) != 0)
+        strcpy(response, "RAU 0\n");
+
+    else {
+        u = get_user(uid);
+
+        lock_user(uid);
+
+        /* vc must match the one sent for this rid */
+        if (!(o = find_op(u, rrid, 0)) || rvc != o->vc) strcpy(response, "RAU 0\n");
+
+        /* token asked for and configured; nothing left to track here */
+        else if (strcmp(mode, "T") == 0 && token_keylen) {
+            make_token(uid, o, token);
+            sprintf(response, "RAU %s\n", token);
+
+            repl_op(REPL_OP_DEL, uid, o);
+            free_op(u, o);
+        }
+
+        else {
+            /* tids must be unique among the user's live operations */
+            tid = generate_tid(uid);  // unique among the user's live tids
+
+            sprintf(response, "RAU %d\n", tid);
+
+            /* issue tid; validate_operation() reads it from here */
+            set_tid(o, tid);
+            arm_expiry(o, tid_ttl);
+            repl_op(REPL_TID, uid, o);
+
+            if (persist_mode) save_tids(uid);
+
+            /* "TID uid tid exp op mac [fname]"; wall clock exp as in tokens, 0 lives until evicted */
+            exp = tid_ttl ? time(NULL) + tid_ttl : 0;
+            push_mac(uid, tid, o->op, exp, o->fname, mac);
+
+            if (strcmp(o->fname, "") == 0) sprintf(push, "TID %s %d %08x %c %s\n", uid, tid, exp, o->op, mac);
+            else sprintf(push, "TID %s %d %08x %c %s %s\n", uid, tid, exp, o->op, mac, o->fname);
+            issued = 1;
+        }
+
+        unlock_user(uid);
+
+        if (nfs && issued) push_tid(s->worker, push);
+    }
+
+    write_tcp(s, response);
+}
+
+
+uint32_t user_gen(char *uid) {  // gen of uid's current record; 0 if none or uid malformed
+    user_record rec;
+    uint32_t gen = 0;
+
+    if (strlen(uid) != 5 || !is_only(NUMERIC, uid)) return 0;
+
+    lock_user(uid);
+    if (read_user(uid, &rec)) gen = rec.gen;
+    unlock_user(uid);
+
+    return gen;
+}
+
+
+int cached_reply(udp_worker *w, char *rcode) {  // answer an exact retransmit from memory; else claim its slot for the reply
+    reply_entry *e;
+    uint32_t h = 2166136261u;
+    char uid[8];
+    int len = strlen(w->buffer), i, vld = strcmp(rcode, "VLD ") == 0;
+
+    if (!w->replies || len >= REPLY_REQ) return 0;
+
+    /* fnv-1a over source address and request */
+    for (i = 0; i < len; i++) { h ^= (unsigned char) w->buffer[i]; h *= 16777619u; }
+    h ^= w->addr.sin_addr.s_addr; h *= 16777619u;
+    h ^= w->addr.sin_port; h *= 16777619u;
+
+    e = &w->replies[h % REPLY_CACHE];
+
+    bzero(uid, 8);
+    if (!vld) sscanf(w->buffer, "%*s %7s", uid);
+
+    if (e->expires > now_ms() && e->reqlen == len && e->addr.sin_addr.s_addr == w->addr.sin_addr.s_addr &&
+        e->addr.sin_port == w->addr.sin_port && memcmp(e->request, w->buffer, len) == 0 &&
+        (vld || e->gen == user_gen(uid))) {
+        w->reply_hits++;
+        reply_udp(w, e->response);
+
+        return 1;
+    }
+
+    /* miss; the entry is overwritten once the reply is known */
+    w->reply_misses++;
+
+    e->expires = 0;
+    e->addr = w->addr;
+    e->reqlen = len;
+    memcpy(e->request, w->buffer, len);
+    w->pending = e;
+
+    return 0;
+}
+
+
+void store_reply(udp_worker *w, char *response) {  // complete the slot claimed by cached_reply()
+    reply_entry *e = w->pending;
+    char uid[8];
+    int vld = strncmp(e->request, "VLD ", 4) == 0;
+
+    w->pending = NULL;
+
+    if (strlen(response) >= REPLY_RESP) return;
+
+    strcpy(e->response, response);
+
+    /* gen after this request ran; a retransmit only replays if nothing changed since */
+    bzero(uid, 8);
+    if (!vld) sscanf(e->request, "%*s %7s", uid);
+    e->gen = vld ? 0 : user_gen(uid);
+
+    e->expires = now_ms() + (vld ? REPLY_VLD_TTL : REPLY_TTL);
+}
+
+
+void reply_udp(udp_worker *w, char *response) {  // queue response to current datagram's sender
+    int len = strlen(response), i = w->nout;
+
+    if (w->stat_op >= 0) { count_op(w->stats, w->stat_op, response, w->started); w->stat_op = -1; }
+    if (w->pending) store_reply(w, response);
+
+    memcpy(w->bufs_out[i], response, len);
+    w->addrs_out[i] = w->addr;
+
+    w->iovs_out[i].iov_base = w->bufs_out[i];
+    w->iovs_out[i].iov_len = len;
+
+    memset(&w->msgs_out[i], 0, sizeof(struct mmsghdr));
+    w->msgs_out[i].msg_hdr.msg_name = &w->addrs_out[i];
+    w->msgs_out[i].msg_hdr.msg_namelen = w->addrlen;
+    w->msgs_out[i].msg_hdr.msg_iov = &w->iovs_out[i];
+    w->msgs_out[i].msg_hdr.msg_iovlen = 1;
+
+    w->nout++;
+}
+
+
+void flush_udp(udp_worker *w) {  // send queued responses; lost ones will timeout
+    int sent = 0, ret;
+
+    while (sent < w->nout) {
+        ret = sendmmsg(w->fd, w->msgs_out + sent, w->nout - sent, 0);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            break;  // socket buffer full; drop rest
+        }
+
+        sent += ret;
+    }
+
+    w->nout = 0;
+}
+
+
+void setup_admission() {  // bucket locks; the global bucket starts full
+    int i;
+
+    for (i = 0; i < RATE_STRIPES; i++) pthread_mutex_init(&source_locks[i], NULL);
+    pthread_mutex_init(&global_lock, NULL);
+
+    global_bucket.tokens = global_rate * 1000LL;
+    global_bucket.stamp = now_ms();
+}
+
+
+int take_tokens(rate_bucket *b, int rate, int want, long long now) {  // refill for the time passed, then take up to want; caller holds bucket lock
+    /* now is read before the lock; a thread that got it later may have moved stamp past it */
+    if (now > b->stamp) {
+        b->tokens += (now - b->stamp) * rate;
+        if (b->tokens > rate * 1000LL) b->tokens = rate * 1000LL;
+        b->stamp = now;
+    }
+
+    if (want > b->tokens / 1000) want = b->tokens / 1000;
+    b->tokens -= want * 1000LL;
+
+    return want;
+}
+
+
+int admit_source(struct in_addr *addr, long long now) {  // one token from the source ip's bucket; 0 sheds
+    unsigned h = addr->s_addr * 2654435761u >> (32 - RATE_SOURCE_BITS);
+    rate_bucket *b = &sources[h];
+    int ok;
+
+    pthread_mutex_lock(&source_locks[h % RATE_STRIPES]);
+
+    /* new source, or one that evicted it; starts with a full bucket */
+    if (b->addr != addr->s_addr) {
+        b->addr = addr->s_addr;
+        b->tokens = source_rate * 1000LL;
+        b->stamp = now;
+    }
+
+    ok = take_tokens(b, source_rate, 1, now);
+
+    pthread_mutex_unlock(&source_locks[h % RATE_STRIPES]);
+
+    return ok;
+}
+
+
+int known_fs(struct in_addr *addr) {  // -F nodes and -f push targets
+    int i;
+
+    for (i = 0; i < nfs_known; i++) if (fs_known[i].s_addr == addr->s_addr) return 1;
+    for (i = 0; i < nfs; i++) if (fs_push[i].sin_addr.s_addr == addr->s_addr) return 1;
+
+    return 0;
+}
+
+
+int is_priority(udp_worker *w, int i) {  // datagram i of the batch is a validation from a known fs
+    char *buf = w->bufs_in[i];
+
+    if (w->msgs_in[i].msg_len < 4 || (memcmp(buf, "VLD ", 4) != 0 && memcmp(buf, "VLB ", 4) != 0)) return 0;
+
+    return known_fs(&w->addrs_in[i].sin_addr);
+}
+
+
+void serve_datagram(udp_worker *w, int i) {  // serve datagram i of the batch; reply is queued
+    char rcode[5];
+    ssize_t len;
+
+    len = w->msgs_in[i].msg_len;
+    memcpy(w->buffer, w->bufs_in[i], len);
+    w->buffer[len] = '\0';
+
+    w->addr = w->addrs_in[i];
+    w->addrlen = w->msgs_in[i].msg_hdr.msg_namelen;
+
+    inet_ntop(AF_INET, &w->addr.sin_addr, w->cip, sizeof(w->cip));
+    w->cport = ntohs(w->addr.sin_port);
+
+    bzero(rcode, 5);
+    strncpy(rcode, w->buffer, 4);
+
+    w->started = now_us();
+
+    if (strcmp(rcode, "REG ") == 0) w->stat_op = STAT_REG;
+    else if (strcmp(rcode, "UNR ") == 0) w->stat_op = STAT_UNR;
+    else if (strcmp(rcode, "VLD ") == 0) w->stat_op = STAT_VLD;
+    else if (strcmp(rcode, "VLB ") == 0) w->stat_op = STAT_VLB;
+    else w->stat_op = -1;
+
+    /* retransmitted REG, UNR or VLD; answered as the first time, without running it again */
+    if (w->stat_op >= 0 && w->stat_op != STAT_VLB && cached_reply(w, rcode)) return;
+
+    /* perform operation acording to rcode; error if invalid */
+    if (strcmp(rcode, "REG ") == 0) register_user(w);
+    else if (strcmp(rcode, "UNR ") == 0) unregister_user(w);
+    else if (strcmp(rcode, "VLD ") == 0) validate_operation(w);
+    else if (strcmp(rcode, "VLB ") == 0) validate_batch(w);
+    else if (strcmp(rcode, "LAG\n") == 0) report_lag(w);
+    else if (strcmp(rcode, "STA\n") == 0) report_stats(w);
+    else protocol_error_udp(w);
+}
+
+
+void serve_udp(udp_worker *w) {  // drain udp socket in batches; requests are served inline (no fork)
+    int lane[BATCH_MAX];  // 0 shed, 1 priority, 2 admitted by source
+    int nrecv, i, pass, want, granted;
+    long long now = 0;
+
+    while (1) {
+        for (i = 0; i < batch_size; i++) w->msgs_in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        nrecv = recvmmsg(w->fd, w->msgs_in, batch_size, 0, NULL);
+        if (nrecv == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fputs("Error: Could not get response from server. Try again!\n", stderr);
+
+            return;  // socket drained
+        }
+
+        w->batch_fill[nrecv]++;
+
+        if (source_rate || global_rate) now = now_ms();
+
+        /* sort the batch into lanes; shed datagrams are never parsed or answered */
+        for (i = want = 0; i < nrecv; i++) {
+            if ((nfs_known || nfs) && is_priority(w, i)) lane[i] = 1;
+            else if (source_rate && !admit_source(&w->addrs_in[i].sin_addr, now)) { lane[i] = 0; w->shed_source++; }
+            else { lane[i] = 2; want++; }
+        }
+
+        /* one global lock per batch */
+        granted = want;
+        if (global_rate && want) {
+            pthread_mutex_lock(&global_lock);
+            granted = take_tokens(&global_bucket, global_rate, want, now);
+            pthread_mutex_unlock(&global_lock);
+        }
+
+        /* priority lane first */
+        for (pass = 1; pass <= 2; pass++)
+            for (i = 0; i < nrecv; i++) {
+                if (lane[i] != pass) continue;
+
+                if (pass == 1) w->priority++;
+                else if (granted-- <= 0) { w->shed_global++; continue; }
+
+                serve_datagram(w, i);
+            }
+
+        flush_udp(w);
+
+        if (nrecv < batch_size) return;  // short batch; socket drained
+    }
+}
+
+
+void *udp_worker_loop(void *arg) {  // event loop of one udp worker
+    udp_worker *w = arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    int fd_epoll, nev, i;
+
+    w->stats = &shared->stats[w->id];
+    w->stat_op = -1;
+
+    w->replies = calloc(REPLY_CACHE, sizeof(reply_entry));  // no cache if this fails
+
+    for (i = 0; i < batch_size; i++) {
+        w->iovs_in[i].iov_base = w->bufs_in[i];
+        w->iovs_in[i].iov_len = UDP_BUF;
+
+        w->msgs_in[i].msg_hdr.msg_name = &w->addrs_in[i];
+        w->msgs_in[i].msg_hdr.msg_iov = &w->iovs_in[i];
+        w->msgs_in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    fd_epoll = epoll_create1(0);
+    if (fd_epoll == -1) { fputs("Error: Could not set up AS UDP socket. Exiting...\n", stderr); exit(1); }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = w->fd;
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, w->fd, &ev) == -1) {
+        fputs("Error: Could not set up AS UDP socket. Exiting...\n", stderr); exit(1); }
+
+    while (1) {
+        nev = epoll_wait(fd_epoll, events, MAX_EVENTS, -1);
+        if (nev == -1) {
+            if (errno == EINTR) continue;
+            fputs("Error: Could not get response from server. Try again!\n", stderr); break;
+        }
+
+        for (i = 0; i < nev; i++)
+            if (events[i].data.fd == w->fd) serve_udp(w);
+    }
+
+    close(fd_epoll);
+
+    return NULL;
+}
+
+
+void expire_state() {  // drop operations past their vc or tid ttl; run each tick by the udp main thread
+    timer_node due, *n;
+    op_slot *o, *batch[64];
+    char uid[12];
+    int i, count, owner, issued;
+
+    due.prev = due.next = &due;
+
+    pthread_mutex_lock(&shared->wheel_lock);
+    timer_advance(&shared->wheel, tick_now(), &due);
+    pthread_mutex_unlock(&shared->wheel_lock);
+
+    /* due list is only touched under wheel lock; user locks are taken after it is released */
+    do {
+        pthread_mutex_lock(&shared->wheel_lock);
+        for (count = 0; count < 64 && (n = due.next) != &due; count++) {
+            timer_del(n);
+            batch[count] = (op_slot*) ((char*) n - offsetof(op_slot, timer));
+        }
+        pthread_mutex_unlock(&shared->wheel_lock);
+
+        for (i = 0; i < count; i++) {
+            o = batch[i];
+            if ((owner = o->uid) < 0) continue;  // freed meanwhile
+            sprintf(uid, "%05d", owner);
+
+            lock_user(uid);
+
+            /* slot may have been freed, reused or rearmed since it fired */
+            if (o->uid == owner && expired(o->expires)) {
+                issued = o->tid != 0;
+                repl_op(REPL_OP_DEL, uid, o);
+                free_op(get_user(uid), o);
+
+                if (persist_mode && issued) save_tids(uid);
+            }
+
+            /* fired before its deadline; put it back rather than lose the slot */
+            else if (o->uid == owner && o->expires) arm_expiry_at(o, o->expires);
+
+            unlock_user(uid);
+        }
+    } while (count == 64);
+}
+
+
+void repl_init(repl_record *r, int type, char *uid) {  // empty record of type for uid
+    memset(r, 0, sizeof(repl_record));
+
+    r->type = type;
+    r->uid = atoi(uid);
+    r->epoch = shared->repl_epoch;
+}
+
+
+void op_record(repl_record *r, int type, char *uid, op_slot *o) {  // record for o's vc or tid; expiry in wall clock
+    repl_init(r, type, uid);
+
+    r->rid = o->rid;
+    r->vc = o->vc;
+    r->tid = o->tid;
+    r->op = o->op;
+    strcpy(r->fname, o->fname);
+    r->expires = o->expires ? o->expires - now_ms() + wall_ms() : 0;
+}
+
+
+void repl_append(repl_record *r) {  // log a state change for replicas and the journal; caller holds user lock
+    uint64_t one = 1;
+
+    if (!repl_logging) return;
+
+    r->stamp = wall_ms();
+
+    pthread_mutex_lock(&shared->repl_lock);
+    r->seq = ++shared->repl_head;
+    shared->repl_ring[r->seq % REPL_RING] = *r;
+    pthread_mutex_unlock(&shared->repl_lock);
+
+    if (fd_replwake != -1 && write(fd_replwake, &one, sizeof(one)) == -1) return;  // shipper is awake anyway
+}
+
+
+void repl_user(char *uid, user_record *rec) {  // registration changed
+    repl_record r;
+
+    if (!repl_logging) return;
+
+    repl_init(&r, REPL_USER, uid);
+    r.rec = *rec;
+    repl_append(&r);
+}
+
+
+void repl_login(char *uid, user_session *u) {  // login count changed
+    repl_record r;
+
+    if (!repl_logging) return;
+
+    repl_init(&r, REPL_LOGIN, uid);
+    r.logins = u->logins;
+    repl_append(&r);
+}
+
+
+void repl_op(int type, char *uid, op_slot *o) {  // vc sent, tid issued, or either dropped
+    repl_record r;
+
+    if (!repl_logging) return;
+
+    op_record(&r, type, uid, o);
+    repl_append(&r);
+}
+
+
+int read_ring(uint64_t next, repl_record *chunk) {  // up to REPL_CHUNK records from seq next; -1 if overwritten
+    uint64_t head;
+    int count;
+
+    pthread_mutex_lock(&shared->repl_lock);
+
+    head = shared->repl_head;
+
+    if (head >= next + REPL_RING) count = -1;
+    else for (count = 0; count < REPL_CHUNK && next + count <= head; count++)
+        chunk[count] = shared->repl_ring[(next + count) % REPL_RING];
+
+    pthread_mutex_unlock(&shared->repl_lock);
+
+    return count;
+}
+
+
+int user_records(char *uid, repl_record *recs, int with_user) {  // uid's record, login and live ops; caller holds user lock
+    user_session *u = get_user(uid);
+    user_record rec;
+    op_slot *o;
+    int i, count = 0;
+
+    if (with_user && read_user(uid, &rec)) { repl_init(&recs[count], REPL_USER, uid); recs[count++].rec = rec; }
+
+    if (u->logins) { repl_init(&recs[count], REPL_LOGIN, uid); recs[count++].logins = u->logins; }
+
+    for (i = u->ops; i; i = o->next) {
+        o = &shared->ops[i];
+        if (!expired(o->expires)) op_record(&recs[count++], o->tid ? REPL_TID : REPL_VC, uid, o);
+    }
+
+    return count;
+}
+
+
+void repl_mac(char *nonce, unsigned epoch, unsigned long long seq, char *mac) {  // 16 hex; a SUB answering challenge nonce
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    sprintf(msg, "SUB %s %u %llu", nonce, epoch, seq);
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+
+void mask_pass(char *nonce, repl_record *r) {  // xor a shipped password with a keystream per connection and write; its own inverse
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    if (r->type != REPL_USER) return;
+
+    sprintf(msg, "PASS %s %d %u", nonce, r->uid, r->rec.gen);
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) r->rec.pass[i] ^= digest[i];
+}
+
+
+int send_masked(repl_peer *p, repl_record *r, int count) {  // send_records() with passwords masked for p
+    int i;
+
+    for (i = 0; i < count; i++) mask_pass(p->nonce, &r[i]);
+
+    return send_records(p->fd, r, count);
+}
+
+
+int send_records(int fd, repl_record *r, int count) {  // whole records or -1; SO_SNDTIMEO bounds a slow replica
+    char *p = (char*) r;
+    size_t len = count * sizeof(repl_record);
+    ssize_t nw;
+
+    while (len > 0) {
+        nw = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (nw == -1 && errno == EINTR) continue;
+        if (nw <= 0) return -1;
+
+        p += nw; len -= nw;
+    }
+
+    return 0;
+}
+
+
+void drop_peer(repl_peer *p) {  // replica lost, lapped or too slow; it reconnects and resubscribes
+    if (verbose_mode) fputs("AS: replica dropped\n", stdout);
+
+    close(p->fd);
+    p->fd = -1;
+    p->subscribed = 0;
+
+    nreplicas--;
+}
+
+
+int send_snapshot(repl_peer *p) {  // RESET, every user's record, login and ops, then SNAP_END; -1 if peer lost
+    repl_record *recs;
+    char uid[12];
+    uint64_t head;
+    int i, count = 0;
+
+    /* later changes are shipped after the snapshot; records are absolute, so seeing one twice is harmless */
+    pthread_mutex_lock(&shared->repl_lock);
+    head = shared->repl_head;
+    pthread_mutex_unlock(&shared->repl_lock);
+
+    recs = calloc(REPL_CHUNK + MAX_OPS_LIMIT + 2, sizeof(repl_record));  // a chunk plus one user's worth
+    if (!recs) return -1;
+
+    repl_init(&recs[count++], REPL_RESET, "0");
+
+    for (i = 0; i < MAX_USERS; i++) {
+        sprintf(uid, "%05d", i);
+
+        lock_user(uid);
+        count += user_records(uid, recs + count, 1);
+        unlock_user(uid);
+
+        if (count >= REPL_CHUNK) {
+            if (send_masked(p, recs, count) == -1) { free(recs); return -1; }
+            count = 0;
+        }
+    }
+
+    repl_init(&recs[count], REPL_SNAP_END, "0");
+    recs[count++].seq = head;
+
+    i = send_masked(p, recs, count);
+    free(recs);
+
+    p->next = head + 1;
+
+    return i;
+}
+
+
+void challenge_peer(repl_peer *p) {  // send "CHL nonce"; only a SUB carrying its mac under the -k key is served
+    char chl[32];
+
+    sprintf(p->nonce, "%04x%04x%04x%04x", random_u16(), random_u16(), random_u16(), random_u16());
+    sprintf(chl, "CHL %s\n", p->nonce);
+
+    if (send(p->fd, chl, strlen(chl), MSG_NOSIGNAL) != (ssize_t) strlen(chl)) drop_peer(p);
+}
+
+
+void subscribe_peer(repl_peer *p) {  // read "SUB epoch seq mac"; resume from seq if the ring still has it, else snapshot
+    char line[64], mac[18], want[17];
+    unsigned long long from = 0;
+    unsigned epoch = 0;
+    uint64_t head;
+    ssize_t len;
+
+    len = recv(p->fd, line, 63, 0);
+    if (len <= 0) { drop_peer(p); return; }
+    line[len] = '\0';
+
+    bzero(mac, 18);
+    if (sscanf(line, "SUB %u %llu %17s", &epoch, &from, mac) != 3) { drop_peer(p); return; }
+
+    /* anyone can reach the port; only holders of the key get user records */
+    repl_mac(p->nonce, epoch, from, want);
+    if (strlen(mac) != 16 || CRYPTO_memcmp(mac, want, 16) != 0) {
+        if (verbose_mode) fputs("AS: replica refused (bad key)\n", stdout);
+        drop_peer(p); return;
+    }
+
+    pthread_mutex_lock(&shared->repl_lock);
+    head = shared->repl_head;
+    pthread_mutex_unlock(&shared->repl_lock);
+
+    if (epoch == shared->repl_epoch && from >= 1 && from <= head + 1 && head + 1 - from < REPL_RING) p->next = from;
+    else if (send_snapshot(p) == -1) { drop_peer(p); return; }
+
+    p->subscribed = 1;
+
+    if (verbose_mode) fprintf(stdout, "AS: replica subscribed (%s from %llu)\n",
+                              p->next == from ? "resumed" : "snapshot", (unsigned long long) p->next);
+}
+
+
+int ship_records(repl_peer *p) {  // send p everything logged since p->next; -1 if lapped or lost
+    repl_record chunk[REPL_CHUNK];
+    int count;
+
+    while (1) {
+        count = read_ring(p->next, chunk);  // -1: overwritten before it was sent
+
+        if (count <= 0) return count;
+        if (send_masked(p, chunk, count) == -1) return -1;
+
+        p->next += count;
+    }
+}
+
+
+void *repl_ship_loop(void *arg) {  // primary: accept replicas and stream the log to them; beats carry the last seq
+    repl_peer peers[REPL_MAX];
+    struct pollfd pfds[REPL_MAX + 2];
+    struct timeval tv;
+    repl_record beat;
+    long long last_beat = 0;
+    uint64_t wake;
+    int i, fd, on = 1;
+
+    for (i = 0; i < REPL_MAX; i++) peers[i].fd = -1;
+
+    tv.tv_sec = REPL_TIMEOUT / 1000;
+    tv.tv_usec = REPL_TIMEOUT % 1000 * 1000;
+
+    while (1) {
+        pfds[0].fd = fd_repl;
+        pfds[1].fd = fd_replwake;
+        for (i = 0; i < REPL_MAX; i++) pfds[i + 2].fd = peers[i].fd;  // poll skips -1
+        for (i = 0; i < REPL_MAX + 2; i++) { pfds[i].events = POLLIN; pfds[i].revents = 0; }
+
+        if (poll(pfds, REPL_MAX + 2, REPL_BEAT) == -1 && errno != EINTR) {
+            fputs("Error: Could not serve replicas. Exiting...\n", stderr); exit(1); }
+
+        if (pfds[0].revents & POLLIN) {
+            for (i = 0; i < REPL_MAX && peers[i].fd != -1; i++);
+
+            if ((fd = accept(fd_repl, NULL, NULL)) != -1 && i == REPL_MAX) close(fd);  // full
+            else if (fd != -1) {
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+                peers[i].fd = fd;
+                peers[i].subscribed = 0;
+                nreplicas++;
+
+                challenge_peer(&peers[i]);
+            }
+        }
+
+        if (pfds[1].revents & POLLIN && read(fd_replwake, &wake, sizeof(wake)) == -1) wake = 0;  // reset counter
+
+        for (i = 0; i < REPL_MAX; i++) {
+            if (peers[i].fd == -1 || !pfds[i + 2].revents) continue;
+
+            /* replicas only ever send SUB; anything else is eof or garbage */
+            if (!peers[i].subscribed) subscribe_peer(&peers[i]);
+            else drop_peer(&peers[i]);
+        }
+
+        for (i = 0; i < REPL_MAX; i++)
+            if (peers[i].subscribed && ship_records(&peers[i]) == -1) drop_peer(&peers[i]);
+
+        if (now_ms() - last_beat < REPL_BEAT) continue;
+        last_beat = now_ms();
+
+        repl_init(&beat, REPL_BEAT_REC, "0");
+        beat.stamp = wall_ms();
+
+        pthread_mutex_lock(&shared->repl_lock);
+        beat.seq = shared->repl_head;
+        pthread_mutex_unlock(&shared->repl_lock);
+
+        for (i = 0; i < REPL_MAX; i++)
+            if (peers[i].subscribed && send_records(peers[i].fd, &beat, 1) == -1) drop_peer(&peers[i]);
+    }
+
+    return NULL;
+}
+
+
+void reset_replica() {  // drop replicated logins and tids; a snapshot follows
+    user_session *u;
+    char uid[12];
+    int i;
+
+    for (i = 0; i < MAX_USERS; i++) {
+        u = &shared->users[i];
+        if (!u->ops && !u->logins) continue;  // only this thread adds to them
+
+        sprintf(uid, "%05d", i);
+
+        lock_user(uid);
+
+        while (u->ops) free_op(u, &shared->ops[u->ops]);
+        u->logins = 0;
+
+        unlock_user(uid);
+    }
+
+    /* resubscribe with a snapshot if this one is cut short */
+    follow_epoch = 0;
+    applied_seq = primary_seq = 0;
+}
+
+
+void apply_record(repl_record *r) {  // replica: replay one logged change
+    user_session *u;
+    op_slot *o;
+    char uid[12];
+
+    if (r->uid < 0 || r->uid >= MAX_USERS) return;
+
+    sprintf(uid, "%05d", r->uid);
+    u = get_user(uid);
+
+    switch (r->type) {
+        case REPL_USER:
+            lock_user(uid);
+            write_user(uid, &r->rec, 0);  // the primary synced it; a lost write comes back with the next snapshot
+            unlock_user(uid);
+
+            break;
+
+        case REPL_LOGIN:
+            lock_user(uid);
+            u->logins = r->logins;
+            unlock_user(uid);
+
+            break;
+
+        case REPL_VC:
+        case REPL_TID:
+            if (r->expires && r->expires <= wall_ms()) break;  // expired in transit
+
+            lock_user(uid);
+
+            /* an issued tid takes over its pending rid */
+            if ((r->tid && (o = find_op(u, 0, r->tid))) || (o = find_op(u, r->rid, 0)) || (o = new_op(uid))) {
+                o->rid = r->rid;
+                o->vc = r->vc;
+                set_tid(o, r->tid);
+                o->op = r->op;
+                r->fname[25] = '\0';
+                strcpy(o->fname, r->fname);
+                arm_expiry_at(o, r->expires ? r->expires - wall_ms() + now_ms() : 0);
+            }
+
+            unlock_user(uid);
+
+            break;
+
+        case REPL_OP_DEL:
+            lock_user(uid);
+            if ((o = find_op(u, r->rid, r->tid))) free_op(u, o);
+            unlock_user(uid);
+
+            break;
+
+        case REPL_RESET:
+            reset_replica();
+
+            return;
+
+        case REPL_SNAP_END:
+            follow_epoch = r->epoch;
+
+            break;
+    }
+
+    if (r->seq > primary_seq) primary_seq = r->seq;
+    if (r->seq && r->type != REPL_BEAT_REC) applied_seq = r->seq;
+
+    if (follow_epoch && applied_seq >= primary_seq) synced_at = now_ms();
+}
+
+
+void *repl_follow_loop(void *arg) {  // replica: subscribe to the primary and apply its log; reconnect on loss
+    repl_record r;
+    struct timeval tv;
+    char chl[REPL_NONCE + 6], nonce[REPL_NONCE + 1], mac[17], sub[64];
+    int fd;
+
+    tv.tv_sec = REPL_DEAD / 1000;
+    tv.tv_usec = REPL_DEAD % 1000 * 1000;
+
+    synced_at = now_ms();
+
+    while (1) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd != -1 && connect(fd, (struct sockaddr*) &repl_primary, sizeof(repl_primary)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));  // no beats this long; primary is gone
+
+            /* "CHL nonce"; answer it with the key */
+            bzero(chl, sizeof(chl)); bzero(nonce, sizeof(nonce));
+            if (recv(fd, chl, REPL_NONCE + 5, MSG_WAITALL) == REPL_NONCE + 5) sscanf(chl, "CHL %16s", nonce);
+
+            repl_mac(nonce, follow_epoch, (unsigned long long) applied_seq + 1, mac);
+            sprintf(sub, "SUB %u %llu %s\n", follow_epoch, (unsigned long long) applied_seq + 1, mac);
+
+            if (strlen(nonce) == REPL_NONCE && write(fd, sub, strlen(sub)) == (ssize_t) strlen(sub)) {
+                repl_connected = 1;
+                if (verbose_mode) fputs("AS: following primary\n", stdout);
+
+                while (recv(fd, &r, sizeof(r), MSG_WAITALL) == sizeof(r)) {
+                    mask_pass(nonce, &r);  // unmask
+                    apply_record(&r);
+                }
+
+                repl_connected = 0;
+                if (verbose_mode) fputs("AS: lost primary; reconnecting\n", stdout);
+            }
+        }
+
+        if (fd != -1) close(fd);
+
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+
+void save_snapshot() {  // rewrite state.snap atomically and restart the journal after it; udp main thread
+    snap_header hdr;
+    repl_record *recs;
+    user_session *u;
+    char uid[12];
+    FILE *snap;
+    int i, count;
+
+    memset(&hdr, 0, sizeof(snap_header));
+    hdr.magic = SNAP_MAGIC;
+    hdr.epoch = shared->repl_epoch;
+
+    /* changes logged after this seq may be missed below; the journal replays them */
+    pthread_mutex_lock(&shared->repl_lock);
+    hdr.seq = shared->repl_head;
+    pthread_mutex_unlock(&shared->repl_lock);
+
+    recs = calloc(MAX_OPS_LIMIT + 1, sizeof(repl_record));  // one user's worth
+    snap = fopen(SNAP_TEMP, "w");
+
+    if (!recs || !snap || fwrite(&hdr, sizeof(snap_header), 1, snap) != 1) {
+        if (verbose_mode) fputs("AS: could not write snapshot\n", stdout);
+        free(recs);
+        if (snap) fclose(snap);
+        return;
+    }
+
+    for (i = 0; i < MAX_USERS; i++) {
+        u = &shared->users[i];
+        if (!u->logins && !u->ops) continue;  // unlocked peek; a user changing now is journaled
+
+        sprintf(uid, "%05d", i);
+
+        lock_user(uid);
+        count = user_records(uid, recs, 0);
+        unlock_user(uid);
+
+        hdr.count += fwrite(recs, sizeof(repl_record), count, snap);
+    }
+
+    free(recs);
+
+    rewind(snap);
+
+    if (fwrite(&hdr, sizeof(snap_header), 1, snap) != 1 || fflush(snap) != 0 || fsync(fileno(snap)) == -1 ||
+        fclose(snap) != 0 || rename(SNAP_TEMP, SNAP_FILE) == -1) {
+        if (verbose_mode) fputs("AS: could not write snapshot\n", stdout);
+        return;  // the old snapshot and its journal stay valid
+    }
+
+    if (ftruncate(fd_journal, 0) == -1) return;  // stale records are skipped on restore by seq
+
+    journal_next = hdr.seq + 1;
+    snap_at = now_ms();
+}
+
+
+void journal_state() {  // append changes logged since the last tick to state.log; udp main thread
+    repl_record chunk[REPL_CHUNK];
+    ssize_t len;
+    int count, wrote = 0;
+
+    while ((count = read_ring(journal_next, chunk)) > 0) {
+        len = count * sizeof(repl_record);
+        if (write(fd_journal, chunk, len) != len) break;  // retried next tick
+
+        journal_next += count;
+        wrote = 1;
+    }
+
+    if (count == -1) save_snapshot();  // lapped; a snapshot covers what was lost
+    else if (wrote) fdatasync(fd_journal);
+}
+
+
+int replayable(repl_record *r) {  // kept by snapshots; registrations are in the store already
+    return r->type == REPL_LOGIN || r->type == REPL_VC || r->type == REPL_TID || r->type == REPL_OP_DEL;
+}
+
+
+void restore_state() {  // startup: map state.snap, replay the journal after it, then start a new snapshot
+    snap_header *hdr = NULL;
+    repl_record r, *recs;
+    user_session *u;
+    struct stat st;
+    long long start = now_ms();
+    char uid[12];
+    int fd, i, snapped = 0, replayed = 0, ops = 0;
+    void *map = MAP_FAILED;
+
+    if (replica || !snap_interval) return;  // replicas are rebuilt by their primary
+
+    fd = open(SNAP_FILE, O_RDONLY);
+
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(snap_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (fd != -1) close(fd);  // mapping stays valid
+
+    if (map != MAP_FAILED) {
+        hdr = map;
+        recs = (repl_record*) (hdr + 1);
+
+        if (hdr->magic != SNAP_MAGIC || st.st_size != (off_t) (sizeof(snap_header) + hdr->count * sizeof(repl_record)))
+            hdr = NULL;  // torn or foreign; start empty
+
+        for (i = 0; hdr && i < (int) hdr->count; i++) {
+            r = recs[i];  // apply_record() writes to it
+            if (replayable(&r)) { apply_record(&r); snapped++; }
+        }
+
+        /* journal records of the same run past the snapshot; a torn last record is cut by the short read */
+        if (hdr && (fd = open(JOURNAL_FILE, O_RDONLY)) != -1) {
+            while (read(fd, &r, sizeof(repl_record)) == sizeof(repl_record))
+                if (r.epoch == hdr->epoch && r.seq > hdr->seq && replayable(&r)) { apply_record(&r); replayed++; }
+
+            close(fd);
+        }
+
+        munmap(map, st.st_size);
+    }
+
+    /* no session survived; clients log in again. tids did; -d files follow them */
+    for (i = 0; i < MAX_USERS; i++) {
+        u = &shared->users[i];
+        ops += u->nops;
+        u->logins = 0;
+
+        if (persist_mode && u->nops) { sprintf(uid, "%05d", i); save_tids(uid); }
+    }
+
+    fd_journal = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd_journal == -1) { fputs("Error: Could not open AS journal. Exiting...\n", stderr); exit(1); }
+
+    repl_logging = 1;
+    save_snapshot();  // new epoch; the old journal is done
+
+    fprintf(stdout, "AS: restored %d snapshot and %d journal records (%d vcs/tids) in %lld ms\n",
+            snapped, replayed, ops, now_ms() - start);
+
+    fflush(stdout);  // not yet unbuffered; avoid a second copy after fork
+}
+
+
+void handle_udp() {  // start udp workers; main thread handles signals and expiry
+    struct timespec tick;
+    pthread_t repl_thread;
+    sigset_t set;
+    int w, sig;
+
+    /* workers inherit blocked signals; only sigwait() below sees them */
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    setup_admission();  // before workers use the buckets
+
+    for (w = 0; w < nworkers; w++) {
+        /* non-blocking socket; serve_udp() drains it on each event */
+        if (fcntl(workers[w].fd, F_SETFL, fcntl(workers[w].fd, F_GETFL) | O_NONBLOCK) == -1) {
+            fputs("Error: Could not set up AS UDP socket. Exiting...\n", stderr); exit(1); }
+
+        if (pthread_create(&workers[w].thread, NULL, udp_worker_loop, &workers[w]) != 0) {
+            fputs("Error: Could not start AS UDP worker. Exiting...\n", stderr); exit(1); }
+    }
+
+    /* replication threads also leave signals to the main thread */
+    if (fd_repl != -1 && pthread_create(&repl_thread, NULL, repl_ship_loop, NULL) != 0) {
+        fputs("Error: Could not start AS replication. Exiting...\n", stderr); exit(1); }
+
+    if (replica && pthread_create(&repl_thread, NULL, repl_follow_loop, NULL) != 0) {
+        fputs("Error: Could not start AS replication. Exiting...\n", stderr); exit(1); }
+
+    while (1) {
+        /* wake every wheel tick to expire vcs and tids */
+        tick.tv_sec = 0;
+        tick.tv_nsec = WHEEL_TICK * 1000000L;
+
+        if ((sig = sigtimedwait(&set, NULL, &tick)) == -1) {
+            expire_state();
+
+            if (fd_journal != -1) {
+                journal_state();
+                if (snap_interval && now_ms() - snap_at >= snap_interval * 1000LL) save_snapshot();
+            }
+
+            continue;
+        }
+
+        if (sig == SIGUSR1) dump_stats();
+        else if (sig == SIGTERM) kill_udp(sig);
+    }
+}
+
+
+void write_tcp(tcp_session *s, char *response) {  // write whole response; session closes if lost
+    ssize_t len = strlen(response), nw;
+    struct pollfd pfd;
+
+    if (s->stat_op >= 0) { count_op(s->worker->stats, s->stat_op, response, s->started); s->stat_op = -1; }
+
+    while (len > 0 && !s->closing) {
+        nw = write(s->fd, response, len);
+
+        if (nw == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* socket buffer full; wait a bit for the client to read */
+            pfd.fd = s->fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, TCP_WRITE_TIMEOUT) <= 0) s->closing = 1;
+
+        } else if (nw == -1 && errno == EINTR) continue;
+        else if (nw <= 0) s->closing = 1;
+        else { response += nw; len -= nw; }
+    }
+}
+
+
+void logout_user(tcp_session *s) {  // drop session's login
+    char path[32];
+    user_session *u = get_user(s->cuid);
+
+    if (verbose_mode) fprintf(stdout, "%s: logout (IP: %s | PORT: %d)\n", s->cuid, s->cip, s->cport);
+
+    lock_user(s->cuid);
+
+    if (u->logins > 0) u->logins--;
+    repl_login(s->cuid, u);
+
+    if (persist_mode && u->logins == 0) {
+        sprintf(path, "%s/login.txt", s->cuid);
+        remove(path);
+    }
+
+    unlock_user(s->cuid);
+
+    bzero(s->cuid, 6);
+}
+
+
+void close_session(tcp_session *s) {  // logout user (if any) and free session
+    if (s->delivery) unlink_delivery(s->delivery);  // drop vc in flight
+
+    timer_del(&s->login_timer);
+
+    free(s->bulk_out);  // batch cut short; nothing was acknowledged
+
+    if (strcmp(s->cuid, "") != 0) logout_user(s);  // user logged in
+
+    close(s->fd);  // also removes it from the worker's epoll set
+    free(s);
+}
+
+
+void drop_session(tcp_session *s) {  // close s once the worker's event batch is done; later events for it are skipped
+    if (s->dropped) return;
+
+    s->closing = s->dropped = 1;
+    s->next_dropped = s->worker->dropped;
+    s->worker->dropped = s;
+}
+
+
+void close_dropped(tcp_worker *w) {  // close sessions dropped during this batch
+    tcp_session *s;
+
+    while ((s = w->dropped)) {
+        w->dropped = s->next_dropped;
+        close_session(s);
+    }
+}
+
+
+void process_requests(tcp_session *s) {  // serve each complete request line; stops while a vc is in flight
+    char *nl;
+    int len;
+
+    while (!s->closing && !s->delivery && (nl = strchr(s->inbuf, '\n'))) {
+        *nl = '\0';
+        len = nl - s->inbuf + 1;
+
+        if (!s->bulk_left) s->started = now_us();  // a BRG batch is timed from its header
+
+        /* perform operation acording to rcode; error if invalid */
+        if (s->bulk_left) bulk_record(s, s->inbuf);  // inside a BRG batch
+        else if (strncmp(s->inbuf, "LOG ", 4) == 0) { s->stat_op = STAT_LOG; login_user(s, s->inbuf + 4); }
+        else if (strncmp(s->inbuf, "REQ ", 4) == 0) { s->stat_op = STAT_REQ; request_operation(s, s->inbuf + 4); }
+        else if (strncmp(s->inbuf, "AUT ", 4) == 0) { s->stat_op = STAT_AUT; authenticate_operation(s, s->inbuf + 4); }
+        else if (strncmp(s->inbuf, "BRG ", 4) == 0) { s->stat_op = STAT_BRG; bulk_register(s, s->inbuf + 4); }
+        else protocol_error_tcp(s);
+
+        /* shift remaining (pipelined) input */
+        memmove(s->inbuf, s->inbuf + len, s->inlen - len + 1);
+        s->inlen -= len;
+    }
+
+    /* request too long */
+    if (!s->closing && !s->delivery && s->inlen == INBUF_SIZE - 1) protocol_error_tcp(s);
+}
+
+
+void hold_input(tcp_session *s) {  // stop polling for input while a full buffer waits on a vc; resume after
+    struct epoll_event ev;
+    int held = !s->closing && s->delivery && s->inlen == INBUF_SIZE - 1;
+
+    if (held == s->held) return;
+
+    /* level triggered; a readable fd we do not read would wake the worker in a loop */
+    ev.events = held ? EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = s;
+    if (epoll_ctl(s->worker->fd_epoll, EPOLL_CTL_MOD, s->fd, &ev) == -1) s->closing = 1;
+    else s->held = held;
+}
+
+
+void serve_session(tcp_session *s) {  // read available input and serve it
+    ssize_t nr;
+
+    while (!s->closing && s->inlen < INBUF_SIZE - 1) {
+        nr = read(s->fd, s->inbuf + s->inlen, INBUF_SIZE - 1 - s->inlen);
+
+        if (nr == -1 && errno == EINTR) continue;
+        if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;  // drained
+        if (nr <= 0) { s->closing = 1; return; }  // client left
+
+        s->inlen += nr;
+        s->inbuf[s->inlen] = '\0';
+
+        process_requests(s);
+
+        /* activity; push back idle login expiry */
+        if (login_ttl && strcmp(s->cuid, "") != 0)
+            timer_set(&s->worker->logins, &s->login_timer, to_ticks(now_ms() + login_ttl * 1000LL));
+    }
+
+    hold_input(s);
+}
+
+
+void expire_logins(tcp_worker *w) {  // close sessions idle for longer than login ttl
+    timer_node due, *n;
+    tcp_session *s;
+
+    due.prev = due.next = &due;
+
+    timer_advance(&w->logins, tick_now(), &due);
+
+    while ((n = due.next) != &due) {
+        timer_del(n);
+        s = (tcp_session*) ((char*) n - offsetof(tcp_session, login_timer));
+
+        if (verbose_mode) fprintf(stdout, "%s: login expired (IP: %s | PORT: %d)\n", s->cuid, s->cip, s->cport);
+
+        drop_session(s);
+    }
+}
+
+
+void accept_sessions(tcp_worker *w) {  // accept pending connections into this worker
+    struct epoll_event ev;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    tcp_session *s;
+    int newfd;
+
+    while (1) {
+        addrlen = sizeof(addr);
+
+        newfd = accept4(fd_tcp, (struct sockaddr*) &addr, &addrlen, SOCK_NONBLOCK);
+        if (newfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // no more pending connections (or another worker took them)
+        }
+
+        if (!(s = calloc(1, sizeof(tcp_session)))) { close(newfd); continue; }
+
+        /* store client ip and port */
+        s->worker = w;
+        s->fd = newfd;
+        s->stat_op = -1;
+        inet_ntop(AF_INET, &addr.sin_addr, s->cip, sizeof(s->cip));
+        s->cport = ntohs(addr.sin_port);
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = s;
+        if (epoll_ctl(w->fd_epoll, EPOLL_CTL_ADD, newfd, &ev) == -1) { close(newfd); free(s); }
+    }
+}
+
+
+void *tcp_worker_loop(void *arg) {  // event loop of one tcp worker
+    tcp_worker *w = arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    tcp_session *s;
+    void *item;
+    int nev, i, timer;
+
+    w->stats = &shared->stats[WORKERS_MAX + (w - tcp_workers)];
+
+    w->fd_epoll = epoll_create1(0);
+    if (w->fd_epoll == -1) { fputs("Error: Could not set up AS TCP socket. Exiting...\n", stderr); exit(1); }
+
+    /* all workers wait on the accept socket; only one is woken per connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->fd_epoll, EPOLL_CTL_ADD, fd_tcp, &ev) == -1) {
+        fputs("Error: Could not set up AS TCP socket. Exiting...\n", stderr); exit(1); }
+
+    setup_udpsocket(w);
+
+    timer_init(&w->logins, tick_now());
+
+    while (1) {
+        timer = check_deliveries(w);  // wake up for the next retransmit or deadline
+
+        if (login_ttl) {
+            expire_logins(w);
+            if (timer == -1 || timer > WHEEL_TICK) timer = WHEEL_TICK;
+        }
+
+        nev = epoll_wait(w->fd_epoll, events, MAX_EVENTS, timer);
+        if (nev == -1) {
+            if (errno == EINTR) continue;
+            fputs("Error: Could not accept connections. Exiting...\n", stderr); exit(1);
+        }
+
+        for (i = 0; i < nev; i++) {
+            if (!(item = events[i].data.ptr)) { accept_sessions(w); continue; }
+
+            if (item == w) { receive_vc(w); continue; }  // udp socket; pd replies
+
+            s = item;
+            if (s->dropped) continue;  // closed by an earlier event of this batch
+
+            serve_session(s);
+
+            if (s->closing || (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                drop_session(s);
         }
+
+        /* only now; events of this batch may still point to these sessions */
+        close_dropped(w);
     }
+
+    return NULL;
+}
+
+
+void handle_tcp() {  // start tcp workers; sessions are multiplexed, not forked
+    int w;
+
+    signal(SIGTERM, kill_tcp);  // kill tcp server if SIGTERM received
+    signal(SIGUSR1, SIG_IGN);  // stats are dumped by the udp server
+    signal(SIGPIPE, SIG_IGN);  // lost clients are handled by write_tcp()
+
+    n = prctl(PR_SET_PDEATHSIG, SIGTERM);  // send SIGTERM to tcp server if udp server exits
+    if (n == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+
+    /* non-blocking accept socket; idle workers must not block in accept() */
+    if (fcntl(fd_tcp, F_SETFL, fcntl(fd_tcp, F_GETFL) | O_NONBLOCK) == -1) {
+        fputs("Error: Could not set up AS TCP socket. Exiting...\n", stderr); exit(1); }
+
+    for (w = 0; w < ntcpworkers; w++)
+        if (pthread_create(&tcp_workers[w].thread, NULL, tcp_worker_loop, &tcp_workers[w]) != 0) {
+            fputs("Error: Could not start AS TCP worker. Exiting...\n", stderr); exit(1); }
+
+    for (w = 0; w < ntcpworkers; w++) pthread_join(tcp_workers[w].thread, NULL);
 }
 
 
@@ -799,6 +3399,16 @@ void setup_server() {
     act.sa_handler = SIG_IGN;
     if (sigaction(SIGCHLD, &act, NULL) == -1) exit(1);
 
+    /* replicas only answer udp reads; no tcp server */
+    if (replica) {
+        setvbuf(stdout, NULL, _IONBF, 0);  // make stdout unbuffered
+
+        handle_udp();
+
+        disconnect_udpserver();  // disconnect udp if something happens
+        return;
+    }
+
     ppid = getpid();
     pid = fork();
 
@@ -818,6 +3428,9 @@ void setup_server() {
         setvbuf(stdout, NULL, _IONBF, 0);  // make stdout unbuffered
 
         disconnect_udpserver();  // udp socket not needed
+        if (fd_repl != -1) close(fd_repl);  // replicas are served by the udp server
+
+        random_left = 0;  // do not repeat the parent's draws
 
         handle_tcp();
 
@@ -827,14 +3440,19 @@ void setup_server() {
 
 
 int main(int argc, char const *argv[]){
-    parse_args(argc, argv);
+    started_at = now_us();  // STA uptime
 
-    srand(time(NULL));  // init random generator
+    parse_args(argc, argv);
 
     setup_udpserver();
-    setup_tcpserver();
+    if (!replica) setup_tcpserver();
+    setup_shared();
+    if (strlen(replport)) setup_replserver();
 
     change_to_dusers();
+    setup_store();
+    scan_store();
+    restore_state();
 
     setup_server();
 
@@ -1,6 +1,12 @@
 #ifndef AS_H
 #define AS_H
 
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
 
 #define IP_INVALID 0
 #define PORT_INVALID 1
@@ -14,32 +20,504 @@
 #define FILE_CHARS 6
 
 #define BACKLOG 100
+#define MAX_EVENTS 64
+#define BATCH_MAX 64
+#define WORKERS_MAX 64
+#define UDP_BUF 1536  // largest datagram in or out (VLB / CNB)
+#define VLB_MAX 32  // entries per batched validation
+#define LOCK_STRIPES 256
+#define MAX_USERS 100000  // uids are 5 digits
+
+#define STORE_FILE "users.db"
+#define STORE_MAGIC 0x41535530  // "ASU0"
+#define USER_EXISTS 1
+#define USER_REGISTERED 2
+#define INBUF_SIZE 128
+#define BULK_MAX 1024  // records per BRG batch; one store flush each
+#define BULK_LINE 48  // longest per-record result line
+#define TCP_WRITE_TIMEOUT 1000  // ms
+#define VC_TIMEOUT_INIT 250  // ms; doubled on each retransmit
+#define VC_DEADLINE 5000  // ms; then RRQ EPD
+
+#define DELIVERY_BUCKETS 256
+
+#define WHEEL_TICK 100  // ms per timer wheel tick
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4  // 64^4 ticks (~19 days); longer timers cascade again
+#define VC_TTL 120  // s; defaults for -V, -I and -L; 0 never expires
+#define TID_TTL 600
+#define LOGIN_TTL 0  // idle logged-in sessions
+
+#define OP_POOL 65536  // operations (vc or tid) live at once, all users
+#define TID_BUCKET_BITS 8
+#define TID_BUCKETS (1 << TID_BUCKET_BITS)  // live tid index buckets per lock stripe
+#define RANDOM_POOL 256  // 16-bit draws per getrandom() call, per thread
+#define MAX_OPS 32  // default for -m; per user
+#define MAX_OPS_LIMIT 1000
+
+#define FS_MAX 8  // -f targets for tid pushes; -F known fss
+
+#define REPLY_CACHE 1024  // replayable replies per udp worker; direct mapped
+#define REPLY_REQ (4 + 5 + 1 + 8 + 1 + 15 + 1 + 5 + 2)  // longest cached request: "REG uid pass pdip pdport\n" and NUL; UNR and VLD are shorter
+#define REPLY_RESP 112
+#define REPLY_TTL 10000  // ms; REG and UNR, covers client retransmits (5 s)
+#define REPLY_VLD_TTL 1000  // ms; bounds how stale a replayed CNF can be
+
+#define RATE_SOURCE_BITS 12
+#define RATE_SOURCES (1 << RATE_SOURCE_BITS)  // per-ip buckets; direct mapped, a new ip takes over its slot
+#define RATE_STRIPES 64
+
+#define REPL_RING 65536  // log records kept for replicas to catch up from
+#define REPL_MAX 8  // replicas connected at once
+#define REPL_BEAT 200  // ms between heartbeats (carry primary's last seq)
+#define REPL_TIMEOUT 1000  // ms; slower replicas are dropped and resubscribe
+#define REPL_DEAD 3000  // ms without records or beats; replica reconnects
+#define REPL_CHUNK 64  // records per write
+#define REPL_NONCE 16  // hex chars in a subscriber challenge
+#define REPL_USER 1  // repl record types
+#define REPL_LOGIN 2
+#define REPL_TID 3
+#define REPL_OP_DEL 4  // vc or tid dropped
+#define REPL_BEAT_REC 5
+#define REPL_RESET 6  // snapshot follows
+#define REPL_SNAP_END 7
+#define REPL_VC 8
+
+#define SNAP_FILE "state.snap"  // live logins, vcs and tids; registrations are in STORE_FILE
+#define SNAP_TEMP "state.snap.tmp"
+#define SNAP_MAGIC 0x41535332  // "ASS2"
+#define JOURNAL_FILE "state.log"  // repl records logged since the snapshot
+#define SNAP_INTERVAL 60  // s; default for -S; 0 disables snapshots and the journal
+
+#define SHARD_MAX 64  // -s map entries
+
+#define KEY_MAX 64  // -k token key bytes used
+#define TOKEN_FIXED 29  // op, expiry (8 hex), nonce (4 hex), mac (16 hex); fname follows
+
+#define STAT_REG 0  // opcodes counted by STA; STAT_PD is the vc round trip inside REQ
+#define STAT_UNR 1
+#define STAT_VLD 2
+#define STAT_VLB 3
+#define STAT_LOG 4
+#define STAT_REQ 5
+#define STAT_AUT 6
+#define STAT_BRG 7
+#define STAT_PD 8
+#define STAT_OPS 9
+#define CODE_OK 0  // reply codes; CODE_E is CNF ... E and RAU 0
+#define CODE_NOK 1
+#define CODE_ERR 2
+#define CODE_EPD 3
+#define CODE_ELOG 4
+#define CODE_EUSER 5
+#define CODE_EFOP 6
+#define CODE_E 7
+#define CODE_RDR 8
+#define STAT_CODES 9
+#define HIST_SUB_BITS 3  // log-linear latency buckets: 8 per power of two, values within 12.5%
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 256  // up to ~2^33 us
+#define STA_BUF 4096
+
+#define PD_CLOSED 0  // pd circuit breaker states
+#define PD_OPEN 1
+#define PD_PROBING 2
+#define BREAKER_FAILS 3  // consecutive failed vcs that open a breaker
+#define BREAKER_COOLDOWN 1000  // ms before first probe; doubles per failed probe
+#define BREAKER_COOLDOWN_MAX 30000
+#define PROBE_UID "-----"  // no registrable uid; pds answer a bare ERR, which still proves them alive
+
+
+typedef struct shard {  // uids first..last are served by the as at ip:port
+    int first, last;
+    char ip[18], port[8];
+    int owned;  // this as
+} shard;
+
+
+typedef struct rate_bucket {  // token bucket; tokens in thousandths, at most one second's worth
+    uint32_t addr;  // source ip; unused for the global bucket
+    long long tokens, stamp;  // stamp: ms of last refill
+} rate_bucket;
+
+
+typedef struct op_stats {  // one opcode in one thread
+    unsigned long count, codes[STAT_CODES];
+    unsigned long hist[HIST_BUCKETS];  // latency, us
+    long long max;  // us
+} op_stats;
+
+
+typedef struct thread_stats {  // written only by its worker thread, without locks; STA sums them all
+    op_stats ops[STAT_OPS];
+} __attribute__((aligned(64))) thread_stats;
+
+
+typedef struct reply_entry {  // answered REG, UNR or VLD; replayed to exact retransmits from the same address
+    struct sockaddr_in addr;
+    uint32_t gen;  // REG, UNR: user's record gen after the reply; any later change misses
+    long long expires;  // ms; 0 unused
+    int reqlen;
+    char request[REPLY_REQ], response[REPLY_RESP];
+} reply_entry;
+
+
+typedef struct udp_worker {  // udp worker thread; one SO_REUSEPORT socket each
+    int id, fd;
+    pthread_t thread;
+    thread_stats *stats;
+
+    /* current request, counted when answered */
+    int stat_op;  // -1 if not counted
+    long long started;  // us
+
+    /* current request */
+    char buffer[UDP_BUF + 1];
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    char cip[18];
+    int cport;
+
+    /* batched io */
+    int nout;
+    struct mmsghdr msgs_in[BATCH_MAX], msgs_out[BATCH_MAX];
+    struct iovec iovs_in[BATCH_MAX], iovs_out[BATCH_MAX];
+    struct sockaddr_in addrs_in[BATCH_MAX], addrs_out[BATCH_MAX];
+    char bufs_in[BATCH_MAX][UDP_BUF], bufs_out[BATCH_MAX][UDP_BUF];
+
+    unsigned long batch_fill[BATCH_MAX + 1];  // number of recvmmsg() calls that returned i datagrams
+    unsigned long priority, shed_source, shed_global;  // admission counters
+
+    /* reply cache; retransmits hash to the same worker, so it is private */
+    reply_entry *replies;
+    reply_entry *pending;  // miss being served; filled by reply_udp()
+    unsigned long reply_hits, reply_misses;
+} udp_worker;
+
+
+typedef struct user_record {  // one copy of a user's credentials; 32 bytes
+    uint32_t gen, sum;  // newest copy with a good sum wins
+    char pass[8];  // not NUL terminated
+    uint32_t pdaddr;  // network order
+    uint16_t pdport;  // network order
+    uint16_t flags;  // USER_EXISTS, USER_REGISTERED
+    char pad[8];
+} user_record;
+
+
+typedef struct user_slot {  // double-buffered record; one cache line
+    user_record copy[2];
+} __attribute__((aligned(64))) user_slot;
+
+
+typedef struct user_store {  // layout of STORE_FILE; slot index is the uid
+    uint32_t magic;
+    user_slot slots[MAX_USERS] __attribute__((aligned(64)));
+} user_store;
+
+
+typedef struct timer_node {  // intrusive timer wheel entry; next is NULL if not armed
+    struct timer_node *prev, *next;
+    long long expires;  // tick
+} timer_node;
+
+
+typedef struct timer_wheel {  // hierarchical timer wheel; slots are circular list heads
+    long long now;  // last tick run
+    timer_node slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel;
+
+
+typedef struct pd_health {  // per-pd circuit breaker; reset by REG and UNR
+    int state, fails;  // fails: consecutive
+    unsigned long ok, failed;
+    int srtt, cooldown;  // ms; srtt 0 until measured
+} pd_health;
+
+
+typedef struct op_slot {  // one operation: pending (REQ, keyed by rid) until AUT issues its tid
+    int uid;  // owner
+    int next;  // owner's chain, or free list; 0 ends
+    int rid, vc, tid;  // tid 0 while pending
+    int tid_next;  // live tid index chain; 0 ends
+    char op, fname[26];
+    long long expires;  // ms; 0 never
+    timer_node timer;  // in shared wheel
+} op_slot;
+
+
+typedef struct user_session {  // per-uid state
+    int logins;  // tcp sessions logged in as this user
+    struct sockaddr_in pd;  // pd endpoint cache; sin_family 0 if unknown
+    pd_health health;
+
+    int nops, ops;  // live operations; first op slot, 0 if none
+} user_session;
+
+
+typedef struct repl_record {  // one state change; shipped raw, replicas run on the same arch
+    uint64_t seq;  // beats and snapshot end: primary's last seq; snapshot records: 0
+    int64_t stamp;  // primary wall clock, ms
+    uint32_t epoch;  // primary's run; replicas resume only within one
+    int32_t type, uid;
+    user_record rec;  // REPL_USER
+    int32_t logins;  // REPL_LOGIN
+    int32_t rid, vc, tid;  // REPL_VC, REPL_TID, REPL_OP_DEL; tid 0 while pending
+    int64_t expires;  // REPL_VC, REPL_TID; wall clock ms, 0 never
+    char op, fname[26];
+} repl_record;
+
+
+typedef struct snap_header {  // start of SNAP_FILE; count records follow
+    uint32_t magic, epoch;
+    uint64_t seq;  // last change included; the journal resumes after it
+    uint32_t count, pad;
+} snap_header;
+
+
+typedef struct repl_peer {  // replica connected to this primary
+    int fd, subscribed;
+    char nonce[REPL_NONCE + 1];  // challenge sent on accept; also masks shipped passwords
+    uint64_t next;  // seq to ship next
+} repl_peer;
+
+
+typedef struct scan_job {  // startup thread's share of USERS/ and of the store
+    pthread_t thread;
+    int *dirs, ndirs;  // uid dirs
+    int first, last;  // store slots [first, last)
+    int purged, imported, cached;
+} scan_job;
+
+
+typedef struct shared_state {  // mapped MAP_SHARED before fork
+    pthread_mutex_t locks[LOCK_STRIPES];  // user uid is guarded by locks[uid % LOCK_STRIPES]
+    unsigned long trips, recoveries, fast_fails, probes;  // breaker counters; atomic
+    pthread_mutex_t wheel_lock;  // taken inside user locks, never around them
+    timer_wheel wheel;  // vc and tid expiry
+
+    pthread_mutex_t pool_lock;  // free list; taken inside user locks
+    int free_ops, used_ops;  // free list head; slots ever handed out
+    op_slot ops[OP_POOL + 1];  // slot 0 is the null index
+    int tid_index[LOCK_STRIPES][TID_BUCKETS];  // issued ops by (uid, tid); row uid % LOCK_STRIPES is guarded by that user lock
+
+    pthread_mutex_t repl_lock;  // innermost; appends from both servers
+    uint64_t repl_head;  // last seq logged
+    uint32_t repl_epoch;
+    repl_record repl_ring[REPL_RING];  // seq % REPL_RING
+
+    thread_stats stats[2 * WORKERS_MAX];  // udp workers, then tcp workers
+
+    user_session users[MAX_USERS];
+} shared_state;
+
+
+struct tcp_worker;
+struct vc_delivery;
+
+
+typedef struct tcp_session {  // one logged (or logging) user connection
+    int fd, closing;
+    struct tcp_worker *worker;
+    struct vc_delivery *delivery;  // REQ waiting for its pd; input is held until it ends
+    int held;  // EPOLLIN dropped; buffer full behind delivery
+    int dropped;  // closing after this event batch
+    struct tcp_session *next_dropped;
+    char cip[18], cuid[6];
+    int cport;
+
+    /* request being answered; -1 if not counted */
+    int stat_op;
+    long long started;  // us
+
+    /* partial request */
+    char inbuf[INBUF_SIZE];
+    int inlen;
+
+    timer_node login_timer;  // idle login expiry; in worker's wheel
+
+    /* BRG batch being read; results are sent once it is flushed */
+    int bulk_left, bulk_count, bulk_len;
+    int bulk_lo, bulk_hi;  // slots written, for msync
+    char *bulk_out;
+} tcp_session;
+
+
+typedef struct vc_delivery {  // vc in flight to a user's pd; probes have no session
+    struct tcp_worker *w;
+    tcp_session *s;
+    struct sockaddr_in pd;
+
+    char key[6];  // uid in request and reply
+    char uid[6], op, fname[26];
+    int vc, rid;
+    char request[64];
+
+    int attempts;
+    int cancelled;  // a newer vc to the same uid and pd took over; no pd outcome
+    long long rto, next_try, deadline, sent;  // ms
+    long long started;  // us; first send, 0 for probes
+
+    struct vc_delivery *prev, *next;  // worker's in-flight list
+    struct vc_delivery *hnext;  // uid hash chain
+} vc_delivery;
+
+
+typedef struct tcp_worker {  // tcp worker thread; one epoll set each
+    int fd_epoll, fd_udp;  // fd_udp sends this worker's vcs to pds and tids to fss
+    pthread_t thread;
+    thread_stats *stats;
+    vc_delivery *deliveries;  // in flight
+    vc_delivery *by_uid[DELIVERY_BUCKETS];
+    timer_wheel logins;
+    tcp_session *dropped;  // closed once the event batch is done
+} tcp_worker;
+
 
 void usage();
 void kill_tcp(int signum);
 void kill_udp(int signum);
-void protocol_error_tcp();
-void protocol_error_udp();
+void dump_stats();
+void protocol_error_tcp(tcp_session *s);
+void protocol_error_udp(udp_worker *w);
 void syntax_error(int error);
 int is_only(int which, char *str);
 void parse_args(int argc, char const *argv[]);
+void load_shards(char *path);
+void own_shards();
+shard *find_shard(char *uid);
+int redirect(char *uid, char *prefix, char *fallback, char *response);
 void setup_udpserver();
 void setup_tcpserver();
-int connect_to_pdserver();
+void setup_replserver();
+void setup_udpsocket(tcp_worker *w);
 void disconnect_udpserver();
 void disconnect_tcpserver();
-void disconnect_from_pdserver();
 void change_to_dusers();
-void generate_vc();
-void generate_tid();
-void register_user();
-void unregister_user();
-void validate_operation();
-int send_vc(char *uid, char op, char *fname);
-void login_user();
-void request_operation();
-void authenticate_operation();
+unsigned random_u16();
+int random_code();
+int generate_vc();
+int generate_tid(char *uid);
+long long now_ms();
+long long wall_ms();
+long long now_us();
+int hist_bucket(long long us);
+long long hist_value(int bucket);
+int reply_code(char *response);
+void count_op(thread_stats *st, int op, char *response, long long started);
+long long percentile(op_stats *os, double q);
+void timer_init(timer_wheel *tw, long long now);
+void timer_del(timer_node *n);
+void timer_link(timer_wheel *tw, timer_node *n);
+void timer_set(timer_wheel *tw, timer_node *n, long long expires);
+void timer_advance(timer_wheel *tw, long long now, timer_node *due);
+long long to_ticks(long long ms);
+long long tick_now();
+int expired(long long expires);
+void arm_expiry(op_slot *o, int ttl);
+void arm_expiry_at(op_slot *o, long long expires);
+int *tid_bucket(int uid, int tid);
+void set_tid(op_slot *o, int tid);
+op_slot *find_op(user_session *u, int rid, int tid);
+op_slot *new_op(char *uid);
+void free_op(user_session *u, op_slot *o);
+void save_tids(char *uid);
+void expire_state();
+void setup_shared();
+user_session *get_user(char *uid);
+uint32_t record_sum(user_record *rec);
+int current_copy(user_slot *slot);
+int read_user(char *uid, user_record *rec);
+void write_user(char *uid, user_record *rec, int sync);
+int import_user(char *uid);
+void *scan_users(void *arg);
+void scan_store();
+void setup_store();
+void lock_user(char *uid);
+void unlock_user(char *uid);
+void register_user(udp_worker *w);
+int register_record(char *uid, char *pass, char *pdip, char *pdport, int sync);
+void unregister_user(udp_worker *w);
+void check_tid(char *uid, char *tid, char *response);
+void validate_operation(udp_worker *w);
+void validate_batch(udp_worker *w);
+long long replica_lag(uint64_t *behind);
+void report_lag(udp_worker *w);
+void report_stats(udp_worker *w);
+int get_pd(char *uid, struct sockaddr_in *pd);
+void link_delivery(tcp_worker *w, vc_delivery *d);
+void start_probe(tcp_worker *w, char *uid, struct sockaddr_in *pd, int delay);
+int pd_outcome(vc_delivery *d, int ok);
+int send_vc(tcp_session *s, char *uid, int rid, char op, char *fname, char *error);
+void unlink_delivery(vc_delivery *d);
+vc_delivery *find_delivery(tcp_worker *w, char *uid, struct sockaddr_in *from);
+void finish_vc(vc_delivery *d, char *response);
+void fail_unreachable(tcp_worker *w);
+void receive_vc(tcp_worker *w);
+int check_deliveries(tcp_worker *w);
+void bulk_register(tcp_session *s, char *request);
+void bulk_record(tcp_session *s, char *line);
+void login_user(tcp_session *s, char *request);
+int op_room(char *uid, int rid);
+void request_operation(tcp_session *s, char *request);
+void read_key(char *path);
+void token_mac(char *uid, char op, unsigned exp, unsigned nonce, char *fname, char *mac);
+void push_mac(char *uid, int tid, char op, unsigned exp, char *fname, char *mac);
+void make_token(char *uid, op_slot *o, char *token);
+void push_tid(tcp_worker *w, char *push);
+void authenticate_operation(tcp_session *s, char *request);
+uint32_t user_gen(char *uid);
+int cached_reply(udp_worker *w, char *rcode);
+void store_reply(udp_worker *w, char *response);
+void reply_udp(udp_worker *w, char *response);
+void flush_udp(udp_worker *w);
+void setup_admission();
+int take_tokens(rate_bucket *b, int rate, int want, long long now);
+int admit_source(struct in_addr *addr, long long now);
+int known_fs(struct in_addr *addr);
+int is_priority(udp_worker *w, int i);
+void serve_datagram(udp_worker *w, int i);
+void serve_udp(udp_worker *w);
+void *udp_worker_loop(void *arg);
+void repl_init(repl_record *r, int type, char *uid);
+void op_record(repl_record *r, int type, char *uid, op_slot *o);
+void repl_append(repl_record *r);
+void repl_user(char *uid, user_record *rec);
+void repl_login(char *uid, user_session *u);
+void repl_op(int type, char *uid, op_slot *o);
+int read_ring(uint64_t next, repl_record *chunk);
+int user_records(char *uid, repl_record *recs, int with_user);
+void repl_mac(char *nonce, unsigned epoch, unsigned long long seq, char *mac);
+void mask_pass(char *nonce, repl_record *r);
+int send_masked(repl_peer *p, repl_record *r, int count);
+int send_records(int fd, repl_record *r, int count);
+void drop_peer(repl_peer *p);
+int send_snapshot(repl_peer *p);
+void challenge_peer(repl_peer *p);
+void subscribe_peer(repl_peer *p);
+int ship_records(repl_peer *p);
+void *repl_ship_loop(void *arg);
+void reset_replica();
+void apply_record(repl_record *r);
+void *repl_follow_loop(void *arg);
+void save_snapshot();
+void journal_state();
+int replayable(repl_record *r);
+void restore_state();
 void handle_udp();
+void write_tcp(tcp_session *s, char *response);
+void logout_user(tcp_session *s);
+void close_session(tcp_session *s);
+void drop_session(tcp_session *s);
+void close_dropped(tcp_worker *w);
+void expire_logins(tcp_worker *w);
+void process_requests(tcp_session *s);
+void hold_input(tcp_session *s);
+void serve_session(tcp_session *s);
+void accept_sessions(tcp_worker *w);
+void *tcp_worker_loop(void *arg);
 void handle_tcp();
 void setup_server();
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // splice, F_SETPIPE_SZ
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,11 +10,20 @@
 #include <sys/socket.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "fs.h"
 
@@ -40,12 +51,38 @@ int uport;
 /* Validated operations */
 char op, fname[26];
 
+/* Validator helper; batches VLDs of all sub-servers into one exchange with as */
+int fd_val;
+struct sockaddr_un addr_val;
+int vld_batch = 1, vld_window = 0;  // 1 entry: plain VLD, as before
+vld_entry queue[VLD_QUEUE];
+int nqueued, ninflight;  // queue[0, ninflight) are in the batch sent to as
+long long batch_deadline;
+
+/* Where batches go; [0] is the as, the rest are its read replicas (-r), taken in turn */
+struct sockaddr_in vld_to[REPLICA_MAX + 1];
+int nvld_to = 1, vld_target;
+
+/* Shard map (-s); each VLD goes to the as owning the uid */
+shard shards[SHARD_MAX];
+int nshards = 0;
+struct sockaddr_in *batch_to;  // as or replica the batch in flight went to
+
+/* Token key shared with as (-k); signed tids are checked without VLD */
+unsigned char token_key[KEY_MAX];
+int token_keylen = 0;
+
+/* Tids pushed by as (udp, on fsport); answered without VLD */
+int fd_push;
+tid_entry tids[TID_TABLE];
+
 /* Verbose control flag */
 int verbose_mode = 0;
 
 
 void usage() {
-    fputs("usage: ./fs  [-q FSport] [-n ASIP] [-p ASport] [-v]\n", stderr);
+    fputs("usage: ./fs  [-q FSport] [-n ASIP] [-p ASport] [-v] [-B batch] [-W window] [-k keyfile]\n"
+          "            [-r ASIP:port]... [-s shardmap]\n", stderr);
     exit(1);
 }
 
@@ -131,16 +168,17 @@ int is_only(int which, char *str) {  // check if string is only numeric, alpha,
 
 
 void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
+    char rip[18], rport[8];
     int opt;
 
-    if (argc > 8) usage();  // numargs in range
+    if (argc > 16 + 2 * REPLICA_MAX) usage();  // numargs in range
 
     /* default values */
     strncpy(asip, "127.0.0.1", 16);
     strncpy(asport, "58046", 6);
     strncpy(fsport, "59046", 6);
 
-    while ((opt = getopt(argc, (char * const*) argv, "q:n:p:v")) != -1) {
+    while ((opt = getopt(argc, (char * const*) argv, "q:n:p:vB:W:k:r:s:")) != -1) {
         if (optarg && optarg[0] == '-') usage();
 
         switch (opt) {
@@ -173,6 +211,43 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 
                 break;
 
+            case 'B':
+                vld_batch = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || vld_batch < 1 || vld_batch > VLB_MAX) usage();
+
+                break;
+
+            case 'W':
+                vld_window = atoi(optarg);
+                if (!is_only(NUMERIC, optarg) || strlen(optarg) > 4 || vld_window > WINDOW_MAX) usage();
+
+                break;
+
+            case 'k':
+                read_key(optarg);
+
+                break;
+
+            case 'r':
+                bzero(rip, 18); bzero(rport, 8);
+                if (nvld_to > REPLICA_MAX || sscanf(optarg, "%17[^:]:%7s", rip, rport) != 2) usage();
+
+                if (!is_only(IP, rip)) syntax_error(IP_INVALID);
+                if (strlen(rport) > 5 || !is_only(NUMERIC, rport) || atoi(rport) > 65535)
+                    syntax_error(PORT_INVALID);
+
+                vld_to[nvld_to].sin_family = AF_INET;
+                inet_pton(AF_INET, rip, &vld_to[nvld_to].sin_addr);
+                vld_to[nvld_to].sin_port = htons(atoi(rport));
+                nvld_to++;
+
+                break;
+
+            case 's':
+                load_shards(optarg);
+
+                break;
+
             default:
                 usage();
         }
@@ -180,6 +255,140 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 }
 
 
+void load_shards(char *path) {  // "first last ip port" per line; '#' starts a comment
+    char line[128], first[8], last[8], ip[18], port[8], *p;
+    FILE *map = fopen(path, "r");
+    int i;
+
+    if (!map) { fputs("Error: Could not read shard map. Exiting...\n", stderr); exit(1); }
+
+    while (fgets(line, 128, map)) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        bzero(first, 8); bzero(last, 8); bzero(ip, 18); bzero(port, 8);
+        if (nshards == SHARD_MAX || sscanf(p, "%7s %7s %17s %7s", first, last, ip, port) != 4 ||
+            strlen(first) != 5 || !is_only(NUMERIC, first) || strlen(last) != 5 || !is_only(NUMERIC, last) ||
+            atoi(first) > atoi(last) || !is_only(IP, ip) || strlen(port) == 0 || strlen(port) > 5 ||
+            !is_only(NUMERIC, port) || atoi(port) > 65535) {
+            fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+
+        for (i = 0; i < nshards; i++)
+            if (atoi(first) <= shards[i].last && atoi(last) >= shards[i].first) {
+                fputs("Error: Shard map ranges overlap. Exiting...\n", stderr); exit(1); }
+
+        shards[nshards].first = atoi(first);
+        shards[nshards].last = atoi(last);
+        strcpy(shards[nshards].ip, ip);
+        sprintf(shards[nshards].port, "%d", atoi(port));
+        inet_pton(AF_INET, ip, &shards[nshards].addr.sin_addr);
+        shards[nshards].addr.sin_family = AF_INET;
+        shards[nshards].addr.sin_port = htons(atoi(port));
+        nshards++;
+    }
+
+    fclose(map);
+
+    if (!nshards) { fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+}
+
+
+shard *find_shard(char *uid) {  // map entry covering uid; NULL if none
+    int u = atoi(uid), i;
+
+    for (i = 0; i < nshards; i++)
+        if (u >= shards[i].first && u <= shards[i].last) return &shards[i];
+
+    return NULL;
+}
+
+
+int known_as(struct in_addr *addr) {  // our as or any as in the shard map
+    int i;
+
+    if (addr->s_addr == ((struct sockaddr_in*) res_as->ai_addr)->sin_addr.s_addr) return 1;
+
+    for (i = 0; i < nshards; i++) if (addr->s_addr == shards[i].addr.sin_addr.s_addr) return 1;
+
+    return 0;
+}
+
+
+void read_key(char *path) {  // load token key; same file as the as' -k
+    FILE *keyfile = fopen(path, "r");
+
+    if (!keyfile) { fputs("Error: Could not read key file. Exiting...\n", stderr); exit(1); }
+
+    token_keylen = fread(token_key, 1, KEY_MAX, keyfile);
+    fclose(keyfile);
+
+    if (token_keylen < 16) { fputs("Error: Key must be at least 16 bytes. Exiting...\n", stderr); exit(1); }
+}
+
+
+void token_mac(char *uid, char op, unsigned exp, unsigned nonce, char *fname, char *mac) {  // 16 hex of hmac-sha256
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    sprintf(msg, "%s %c %08x %04x %s", uid, op, exp, nonce, fname);
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+
+void push_mac(char *uid, int tid, char op, unsigned exp, char *fname, char *mac) {  // 16 hex of hmac-sha256 over a TID push
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen;
+    char msg[64];
+    int i;
+
+    sprintf(msg, "TID %s %d %c %08x %s", uid, tid, op, exp, fname);  // prefixed; never equal to a token's message
+    HMAC(EVP_sha256(), token_key, token_keylen, (unsigned char*) msg, strlen(msg), digest, &dlen);
+
+    for (i = 0; i < 8; i++) sprintf(mac + 2 * i, "%02x", digest[i]);
+}
+
+
+int is_tid(char *tid) {  // classic 4-digit tid, or token shaped
+    int i;
+
+    if (strlen(tid) == 4) return is_only(NUMERIC, tid);
+
+    if (strlen(tid) < TOKEN_FIXED || strlen(tid) > TID_MAX || !strchr("RUDLX", tid[0])) return 0;
+    for (i = 1; i < TOKEN_FIXED; i++) if (!isxdigit(tid[i]) || isupper(tid[i])) return 0;
+
+    return 1;
+}
+
+
+int check_token(char *uid, char *tid) {  // verify signed tid locally; sets op and fname like a CNF would
+    char mac[17], field[9];
+    unsigned exp, nonce;
+
+    if (!token_keylen) return 0;  // tokens need the key; as does not check them
+
+    memcpy(field, tid + 1, 8); field[8] = '\0';
+    exp = strtoul(field, NULL, 16);
+    memcpy(field, tid + 9, 4); field[4] = '\0';
+    nonce = strtoul(field, NULL, 16);
+
+    token_mac(uid, tid[0], exp, nonce, tid + TOKEN_FIXED, mac);
+
+    if (CRYPTO_memcmp(mac, tid + 13, 16) != 0) return 0;  // forged, or not for this uid
+    if (exp && exp < time(NULL)) return 0;  // expired
+
+    op = tid[0];
+    strcpy(fname, tid + TOKEN_FIXED);
+
+    if (verbose_mode) fprintf(stdout, "%s: validate %c %s (token)\n", uid, op, fname);
+
+    return 1;
+}
+
+
 void setup_fsserver() {  // set up fs server to receive and perform operations
     fd_fs = socket(AF_INET, SOCK_STREAM, 0);
     if (fd_fs == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
@@ -242,23 +451,327 @@ void change_to_dusers() {
 }
 
 
-int validate(char *uid, char *tid) {  // validate operation with as
+long long now_ms() {  // monotonic clock in ms
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+void setup_validator() {  // fork validator helper; sub-servers reach it on a unix socket
+    pid_t pid, ppid = getpid();
+
+    /* abstract address; nothing to clean up on exit */
+    memset(&addr_val, 0, sizeof(addr_val));
+    addr_val.sun_family = AF_UNIX;
+    sprintf(addr_val.sun_path + 1, "fs-validator-%d", ppid);
+
+    fd_val = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd_val == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
+
+    if (bind(fd_val, (struct sockaddr*) &addr_val, sizeof(addr_val)) == -1) {
+        fputs("Error: Could not set up validator. Exiting...\n", stderr); exit(1); }
+
+    /* same port number as the tcp server, udp side */
+    fd_push = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_push == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(atoi(fsport));
+    if (bind(fd_push, (struct sockaddr*) &sa, sizeof(sa)) == -1) {
+        fputs("Error: Could not bind FS. Exiting...\n", stderr); exit(1); }
+
+    memcpy(&vld_to[0], res_as->ai_addr, sizeof(struct sockaddr_in));
+
+    pid = fork();
+    if (pid == -1) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+
+    if (pid) { close(fd_val); close(fd_push); return; }  // fs server; sub-servers only send to it
+
+    n = prctl(PR_SET_PDEATHSIG, SIGTERM);  // send SIGTERM to helper if fs exits
+    if (n == -1 || getppid() != ppid) { fputs("Error: Could not fork(). Exiting...\n", stderr); exit(1); }
+
+    close(fd_fs);
+
+    validator_loop();
+}
+
+
+void answer_entry(vld_entry *e, char *response) {  // reply to waiting sub-server; lost if it gave up
+    sendto(fd_val, response, strlen(response), 0, (struct sockaddr*) &e->from, e->fromlen);
+    e->answered = 1;
+}
+
+
+tid_entry *tid_slot(char *uid, char *tid) { return &tids[(atoi(uid) * 10000 + atoi(tid)) % TID_TABLE]; }
+
+
+void receive_pushes() {  // store "TID uid tid exp op mac [fname]" from as; newer tids evict older ones
+    char push[128], uid[8], tid[6], op[3], fname[32], expf[10], mac[18], want[17];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    tid_entry *t;
+    unsigned exp;
+
+    while (1) {
+        fromlen = sizeof(from);
+        bzero(push, 128);
+        if (recvfrom(fd_push, push, 127, MSG_DONTWAIT, (struct sockaddr*) &from, &fromlen) <= 0) return;
+
+        /* only our ases may authorize operations; the source address alone is easy to share or spoof */
+        if (!token_keylen || !known_as(&from.sin_addr)) continue;
+
+        bzero(uid, 8); bzero(tid, 6); bzero(op, 3); bzero(fname, 32); bzero(expf, 10); bzero(mac, 18);
+        if (sscanf(push, "TID %7s %5s %9s %2s %17s %31s", uid, tid, expf, op, mac, fname) < 5) continue;
+
+        if (strlen(uid) != 5 || !is_only(NUMERIC, uid) || strlen(tid) != 4 || !is_only(NUMERIC, tid) ||
+            strlen(expf) != 8 || strspn(expf, "0123456789abcdef") != 8 || !is_only(OP, op) ||
+            strlen(mac) != 16 || strlen(fname) > 24) continue;
+
+        /* signed by an as holding our key; a replayed push dies with its tid */
+        exp = strtoul(expf, NULL, 16);
+        push_mac(uid, atoi(tid), op[0], exp, fname, want);
+        if (CRYPTO_memcmp(mac, want, 16) != 0 || (exp && exp <= time(NULL))) continue;
+
+        t = tid_slot(uid, tid);
+        strcpy(t->uid, uid);
+        strcpy(t->tid, tid);
+        t->op = op[0];
+        strcpy(t->fname, fname);
+        t->expires = exp ? now_ms() + (exp - time(NULL)) * 1000LL : 0;
+    }
+}
+
+
+int lookup_tid(vld_entry *e) {  // answer from pushed tids; 0 on a miss
+    char response[64];
+    tid_entry *t = tid_slot(e->uid, e->tid);
+
+    if (strcmp(t->uid, e->uid) != 0 || strcmp(t->tid, e->tid) != 0) return 0;
+    if (t->expires && t->expires <= now_ms()) return 0;  // as may know better; ask it
+
+    /* same reply as as would give */
+    if (strcmp(t->fname, "") == 0) sprintf(response, "CNF %s %s %c\n", t->uid, t->tid, t->op);
+    else sprintf(response, "CNF %s %s %c %s\n", t->uid, t->tid, t->op, t->fname);
+
+    answer_entry(e, response);
+
+    return 1;
+}
+
+
+void retry_entry(vld_entry *e) {  // replica did not confirm; the as decides
+    if (verbose_mode) fprintf(stdout, "FS: replica missed %s %s; asking AS\n", e->uid, e->tid);
+
+    e->retry = 1;
+}
+
+
+void send_batch() {  // send queued validations to as or a replica; plain VLD if only one distinct tid
+    char request[16 + VLB_MAX * 12];
+    int i, j, k = 0, len, uniq[VLB_MAX], retry = 0;
+    shard *s = find_shard(queue[0].uid);
+    vld_entry e;
+
+    /* a batch goes to one as; bring the entries of the oldest one's shard forward, in order */
+    for (i = ninflight = 1; i < nqueued && ninflight < vld_batch; i++) {
+        if (find_shard(queue[i].uid) != s) continue;
+
+        e = queue[i];
+        memmove(queue + ninflight + 1, queue + ninflight, (i - ninflight) * sizeof(vld_entry));
+        queue[ninflight++] = e;
+    }
+
+    /* replicas may lag; a tid they did not know goes to the as */
+    for (i = 0; i < ninflight; i++) retry |= queue[i].retry;
+
+    if (s && (s->addr.sin_addr.s_addr != vld_to[0].sin_addr.s_addr || s->addr.sin_port != vld_to[0].sin_port)) {
+        vld_target = 0;  // another shard's as; -r replicas are the -n as's
+        batch_to = &s->addr;
+
+    } else {
+        vld_target = retry ? 0 : (vld_target + 1) % nvld_to;
+        batch_to = &vld_to[vld_target];
+    }
+
+    /* sub-servers waiting for the same tid share one entry */
+    for (i = 0; i < ninflight; i++) {
+        for (j = 0; j < k; j++)
+            if (strcmp(queue[i].uid, queue[uniq[j]].uid) == 0 && strcmp(queue[i].tid, queue[uniq[j]].tid) == 0) break;
+
+        if (j == k) uniq[k++] = i;
+    }
+
+    if (k == 1) len = sprintf(request, "VLD");
+    else len = sprintf(request, "VLB %d", k);
+
+    for (j = 0; j < k; j++) len += sprintf(request + len, " %s %s", queue[uniq[j]].uid, queue[uniq[j]].tid);
+    strcpy(request + len, "\n");
+
+    n = sendto(fd_as, request, strlen(request), 0, (struct sockaddr*) batch_to, sizeof(struct sockaddr_in));
+    if (n == -1) {  // as unreachable; fail the batch now
+        for (i = 0; i < ninflight; i++) {
+            if (vld_target) retry_entry(&queue[i]);
+            else answer_entry(&queue[i], "ERR\n");
+        }
+    }
+
+    batch_deadline = now_ms() + (vld_target ? REPLICA_TIMEOUT : VLD_TIMEOUT);
+}
+
+
+void receive_cnf() {  // answer sub-servers from a CNF or CNB reply
+    char response[2048], uid[6], tid[5], status[4], line[128];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    char *cur, *end;
+    int i;
+
+    bzero(response, 2048);
+    n = recvfrom(fd_as, response, 2047, 0, (struct sockaddr*) &from, &fromlen);
+    if (n <= 0) return;
+
+    /* late reply from an earlier target */
+    if (from.sin_addr.s_addr != batch_to->sin_addr.s_addr || from.sin_port != batch_to->sin_port) return;
+
+    /* as could not parse the batch; its sub-servers fail as a lone VLD would */
+    if (strcmp(response, "ERR\n") == 0) {
+        for (i = 0; i < ninflight; i++) {
+            if (vld_target) retry_entry(&queue[i]);
+            else answer_entry(&queue[i], "ERR\n");
+        }
+
+        return;
+    }
+
+    /* one CNF line per entry; a CNB header line is skipped */
+    for (cur = response; (end = strchr(cur, '\n')); cur = end + 1) {
+        *end = '\0';
+
+        bzero(uid, 6); bzero(tid, 5); bzero(status, 4);
+        if (strncmp(cur, "CNF ", 4) != 0 || sscanf(cur, "%*s %5s %4s %3s", uid, tid, status) < 2) continue;
+
+        sprintf(line, "%.120s\n", cur);
+
+        for (i = 0; i < ninflight; i++) {
+            if (queue[i].answered || strcmp(queue[i].uid, uid) != 0 || strcmp(queue[i].tid, tid) != 0) continue;
+
+            if (vld_target && strcmp(status, "E") == 0) retry_entry(&queue[i]);  // maybe just not shipped yet
+            else if (strcmp(status, "RDR") == 0) answer_entry(&queue[i], "ERR\n");  // shard maps disagree
+            else answer_entry(&queue[i], line);
+        }
+    }
+}
+
+
+void validator_loop() {  // helper: collect validations for up to window ms or batch entries, one exchange at a time
+    char request[32];
+    struct pollfd pfds[3];
+    long long now;
+    int timeout, i, j;
+    vld_entry *e;
+
+    pfds[0].fd = fd_val;
+    pfds[1].fd = fd_as;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = fd_push;
+    pfds[2].events = POLLIN;
+
+    while (1) {
+        now = now_ms();
+
+        if (ninflight) timeout = batch_deadline - now;
+        else if (nqueued) timeout = queue[0].arrived + vld_window - now;
+        else timeout = -1;
+        if (timeout < -1) timeout = 0;
+
+        pfds[0].events = nqueued < VLD_QUEUE ? POLLIN : 0;  // full; leave the rest in the socket
+
+        if (poll(pfds, 3, timeout) == -1 && errno != EINTR) exit(1);
+
+        if (pfds[2].revents & POLLIN) receive_pushes();
+
+        /* new validations from sub-servers: "uid tid" */
+        while (nqueued < VLD_QUEUE) {
+            e = &queue[nqueued];
+            e->fromlen = sizeof(e->from);
+
+            bzero(request, 32);
+            if (recvfrom(fd_val, request, 31, MSG_DONTWAIT, (struct sockaddr*) &e->from, &e->fromlen) <= 0) break;
+
+            bzero(e->uid, 6); bzero(e->tid, 5);
+            sscanf(request, "%5s %4s", e->uid, e->tid);
+            e->arrived = now_ms();
+            e->answered = e->retry = 0;
+
+            if (!lookup_tid(e)) nqueued++;  // miss; VLD
+        }
+
+        if (ninflight && (pfds[1].revents & POLLIN)) receive_cnf();
+
+        /* as never answered; a silent replica hands its entries to the as */
+        if (ninflight && now_ms() >= batch_deadline)
+            for (i = 0; i < ninflight; i++) {
+                if (queue[i].answered || (vld_target && queue[i].retry)) continue;
+
+                if (vld_target) retry_entry(&queue[i]);
+                else answer_entry(&queue[i], "ERR\n");
+            }
+
+        /* batch is done once every entry is answered or set for retry; drop answered ones from the queue */
+        if (ninflight) {
+            for (i = 0; i < ninflight && (queue[i].answered || (vld_target && queue[i].retry)); i++);
+
+            if (i == ninflight) {
+                for (i = j = 0; i < nqueued; i++) if (!queue[i].answered) queue[j++] = queue[i];
+                nqueued = j;
+                ninflight = 0;
+            }
+        }
+
+        else if (pfds[1].revents & POLLIN) recv(fd_as, request, 32, MSG_DONTWAIT);  // late reply; drop
+
+        /* next batch when full or the oldest waited its window */
+        if (!ninflight && nqueued && (nqueued >= vld_batch || now_ms() >= queue[0].arrived + vld_window))
+            send_batch();
+    }
+}
+
+
+int validate(char *uid, char *tid) {  // validate operation with as, through the validator helper
     char request[20], response[128];
     char pcode[5];
     char vuid[6], vtid[5];
+    struct sockaddr_un me;
+    int fd;
+
+    if (strlen(tid) != 4) return check_token(uid, tid);  // signed tid; no as round trip
 
-    sprintf(request, "VLD %s %s\n", uid, tid);
+    sprintf(request, "%s %s", uid, tid);
 
-    n = strlen(request);
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1) protocol_error();
+
+    /* autobind; helper replies to this address */
+    memset(&me, 0, sizeof(me));
+    me.sun_family = AF_UNIX;
+    if (bind(fd, (struct sockaddr*) &me, sizeof(sa_family_t)) == -1) protocol_error();
+
+    timeout.tv_sec = VLD_TIMEOUT / 1000 + 1;  // helper gives up on as first
+    timeout.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) protocol_error();
 
     /* send request */
-    n = sendto(fd_as, request, strlen(request), 0, res_as->ai_addr, res_as->ai_addrlen);
+    n = sendto(fd, request, strlen(request), 0, (struct sockaddr*) &addr_val, sizeof(addr_val));
     if (n == -1) protocol_error();
 
     /* clear receive buffer, read response */
     bzero(response, 128);
-    addrlen_as = sizeof(addr_as);
-    n = recvfrom(fd_as, response, 128, 0, (struct sockaddr*) &addr_as, &addrlen_as);
+    n = recv(fd, response, 127, 0);
+    close(fd);
     if (n == -1) protocol_error();
 
     /* check as response */
@@ -296,7 +809,7 @@ int validate(char *uid, char *tid) {  // validate operation with as
 
 void list_files() {  // list user files
     char request[128], response[1024];
-    char ruid[6], rtid[5];
+    char ruid[7], rtid[TID_MAX + 2];
     char finfo[50];
     DIR *udir;
     FILE *ufile;
@@ -307,11 +820,11 @@ void list_files() {  // list user files
     if ((n = read(fd_fs, buffer, 127)) > 0)
         strncpy(request, buffer, 127);  // read request
 
-    sscanf(request, "%s %s", ruid, rtid);
+    sscanf(request, "%6s %54s", ruid, rtid);
 
     bzero(response, 1024);
     if (strlen(ruid) != 5 || !is_only(NUMERIC, ruid) ||
-        strlen(rtid) != 4 || !is_only(NUMERIC, rtid))
+        !is_tid(rtid))
         strcpy(response, "RLS ERR\n");  // format error
 
     else {
@@ -374,22 +887,64 @@ void list_files() {  // list user files
 }
 
 
+void write_all(char *data, size_t len) {  // whole buffer to the user; sub-server exits if the user is gone
+    while (len > 0) {
+        if ((nw = write(fd_fs, data, len)) <= 0) exit(1);
+        data += nw; len -= nw;
+    }
+}
+
+
+int send_file(int fd, long long size) {  // stream size bytes of fd to the user, zero-copy where possible; -1 if lost
+    off_t offset = 0;
+    ssize_t sent;
+    char *chunk;
+
+    while (offset < size) {
+        sent = sendfile(fd_fs, fd, &offset, size - offset > SENDFILE_MAX ? SENDFILE_MAX : size - offset);
+
+        if (sent > 0) continue;
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == 0 || (errno != EINVAL && errno != ENOSYS)) return -1;  // file shrank, or user gone
+
+        break;  // this file cannot be sent from the page cache; copy the rest
+    }
+
+    if (offset == size) return 0;
+
+    chunk = malloc(COPY_CHUNK);
+    if (!chunk || lseek(fd, offset, SEEK_SET) == -1) { free(chunk); return -1; }
+
+    while (offset < size) {
+        sent = read(fd, chunk, size - offset > COPY_CHUNK ? COPY_CHUNK : size - offset);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) { free(chunk); return -1; }
+
+        write_all(chunk, sent);
+        offset += sent;
+    }
+
+    free(chunk);
+    return 0;
+}
+
+
 void retrive_file() {  // retrieve file from fs
-    char request[128], response[1024];
-    char ruid[6], rtid[5], rfname[26];
+    char request[128], response[128];
+    char ruid[7], rtid[TID_MAX + 2], rfname[26];
     DIR *udir;
-    FILE *toretrieve;
-    int fsize;
+    struct stat st;
+    int fd, on = 1, off = 0;
 
     bzero(buffer, 128);
     if ((n = read(fd_fs, buffer, 127)) > 0)
         strncpy(request, buffer, 127);  // read request
 
-    sscanf(request, "%s %s %s", ruid, rtid, rfname);
+    sscanf(request, "%6s %54s %25s", ruid, rtid, rfname);
 
     bzero(response, 128);
     if (strlen(ruid) != 5 || !is_only(NUMERIC, ruid) ||
-        strlen(rtid) != 4 || !is_only(NUMERIC, rtid) ||
+        !is_tid(rtid) ||
         !is_only(FILENAME, rfname))
         strcpy(response, "RRT ERR\n");  // format error
 
@@ -407,70 +962,137 @@ void retrive_file() {  // retrieve file from fs
 
                 chdir(ruid);  // change to user dir
 
-                toretrieve = fopen(fname, "r");
-                if (toretrieve == NULL) strcpy(response, "RRT EOF\n"); // file not found
+                fd = open(fname, O_RDONLY);
+                if (fd == -1 || fstat(fd, &st) == -1) strcpy(response, "RRT EOF\n"); // file not found
                 else {
-                    /* get file size */
-                    fseek(toretrieve, 0, SEEK_END);
-                    fsize = ftell(toretrieve);
-                    fseek(toretrieve, 0, SEEK_SET);
+                    sprintf(response, "RRT OK %lld ", (long long) st.st_size);  // successful retrieve
 
-                    sprintf(response, "RRT OK %d ", fsize);  // successful retrieve
+                    /* header, body and newline leave in full segments */
+                    setsockopt(fd_fs, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
 
-                    n = strlen(response);
+                    write_all(response, strlen(response));
+                    if (send_file(fd, st.st_size) == -1) exit(1);
+                    write_all("\n", 1);
 
-                    while (n > 0) {  // write response
-                        if ((nw = write(fd_fs, response, n)) <= 0) exit(1);
-                        n -= nw; strcpy(response, &response[nw]);
-                    }
+                    setsockopt(fd_fs, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+                    close(fd); chdir(".."); return;
+                }
+
+                if (fd != -1) close(fd);
+                chdir(".."); // go back
+            }
+        }
+    }
+
+    write_all(response, strlen(response));
+}
+
+
+int read_header(char *header, int max, int *got) {  // read the UPL fields; their length, -1 if malformed; body bytes read with them follow
+    int len = 0, hlen = -1, spaces = 0, i;
+
+    while (hlen == -1 && len < max - 1) {  // uid tid fname size, each followed by a space
+        n = read(fd_fs, header + len, max - 1 - len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (i = len; i < len + n && hlen == -1; i++) {
+            if (header[i] == '\n') { len += n; header[len] = '\0'; *got = len; return -1; }  // short header
+            if (header[i] == ' ' && ++spaces == 4) hlen = i + 1;
+        }
+
+        len += n;
+    }
+
+    header[len] = '\0';
+    *got = len;
+    return hlen;
+}
+
+
+int write_file(int fd, char *data, size_t len) {  // whole buffer to fd; -1 on error
+    ssize_t w;
+
+    while (len > 0) {
+        w = write(fd, data, len);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+
+        data += w; len -= w;
+    }
+
+    return 0;
+}
 
-                    /* write data until eof */
-                    while (!feof(toretrieve)) {
-                        bzero(response, 1024);
-                        n = fread(response, 1, 1023, toretrieve);
 
-                        while (n > 0) {  // write response
-                            if ((nw = write(fd_fs, response, n)) <= 0) exit(1);
-                            n -= nw; strcpy(response, &response[nw]);
-                        }
+int receive_file(int fd, long long size, char *head, int nhead) {  // size bytes from the user into fd, nhead already read; -1 if lost
+    int pipefd[2];
+    ssize_t moved, out;
+    long long done = nhead;
+    char *chunk;
 
-                    } write(fd_fs, "\n", 1); chdir(".."); return;
-                } chdir(".."); // go back
+    if (write_file(fd, head, nhead) == -1) return -1;  // came in with the header
+
+    if (pipe(pipefd) == 0) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);  // best effort; default pipes hold 64K
+
+        while (done < size) {
+            moved = splice(fd_fs, NULL, pipefd[1], NULL, size - done > PIPE_SIZE ? PIPE_SIZE : size - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+            if (moved == -1 && errno == EINTR) continue;
+            if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) break;  // socket cannot be spliced; copy the rest
+            if (moved <= 0) { close(pipefd[0]); close(pipefd[1]); return -1; }  // user gone before fsize
+
+            while (moved > 0) {  // drain the pipe into the file
+                out = splice(pipefd[0], NULL, fd, NULL, moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+                if (out == -1 && errno == EINTR) continue;
+                if (out <= 0) { close(pipefd[0]); close(pipefd[1]); return -1; }
+
+                moved -= out; done += out;
             }
         }
+
+        close(pipefd[0]); close(pipefd[1]);
+        if (done == size) return 0;
     }
 
-    n = strlen(response);
+    chunk = malloc(COPY_CHUNK);
+    if (!chunk) return -1;
 
-    while (n > 0) {  // write response
-        if ((nw = write(fd_fs, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
+    while (done < size) {
+        moved = read(fd_fs, chunk, size - done > COPY_CHUNK ? COPY_CHUNK : size - done);
+        if (moved == -1 && errno == EINTR) continue;
+        if (moved <= 0 || write_file(fd, chunk, moved) == -1) { free(chunk); return -1; }
+
+        done += moved;
     }
+
+    free(chunk);
+    return 0;
 }
 
 
 void upload_file() {
-    char request[1024], response[128];
-    char ruid[6], rtid[5], rfname[26];
+    char header[UPL_HEADER], response[128], end;
+    char ruid[7], rtid[TID_MAX + 2], rfname[26];
     DIR *udir;
-    FILE *uploaded;
+    int uploaded;
     struct dirent *udirent;
-    int nfiles = 0, fsize = -1;
-    int offset = 0, bytes_read = 0, first = 1, nmem;
-
-    bzero(buffer, 1024);
-    bzero(request, 1024);
-    if ((n = read(fd_fs, buffer, 1023)) > 0)
-        memcpy(request, buffer, 1023);  // read request
+    int nfiles = 0, hlen, got, nhead = 0;
+    long long fsize = -1;
 
-    nmem = n;  // store n
-
-    sscanf(request, "%s %s %s %d %n", ruid, rtid, rfname, &fsize, &offset);
+    bzero(ruid, 7); bzero(rtid, TID_MAX + 2); bzero(rfname, 26);
+    if ((hlen = read_header(header, UPL_HEADER, &got)) != -1) {
+        sscanf(header, "%6s %54s %25s %lld", ruid, rtid, rfname, &fsize);
+        nhead = got - hlen;  // body (and maybe the newline) read along with the fields
+    }
 
     bzero(response, 128);
     if (strlen(ruid) != 5 || !is_only(NUMERIC, ruid) ||
-        strlen(rtid) != 4 || !is_only(NUMERIC, rtid) ||
-        !is_only(FILENAME, rfname) || fsize == -1)
+        !is_tid(rtid) ||
+        !is_only(FILENAME, rfname) || fsize < 0)
         strcpy(response, "RUP ERR\n");  // format error
 
     else {
@@ -495,62 +1117,41 @@ void upload_file() {
                 nfiles++;
             }
 
+            closedir(udir);
+
             if (nfiles >= 15) strcpy(response, "RUP FULL\n");  // user directory already at max capacity
             else if (strcmp(response, "RUP DUP\n") != 0) {  // file can be created
                 chdir(ruid);
 
                 /* create file */
-                uploaded = fopen(fname, "w");
-                if (uploaded == NULL) protocol_error();
-
-                n = nmem;  // retrieve n value
-
-                while (n > 0) {
-                    if (first) {
-                        /* start writing to file */
-                        fwrite(request + offset, 1, n - offset, uploaded);
-                        bytes_read -= offset;
-
-                        first = 0;
+                uploaded = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (uploaded == -1) protocol_error();
 
-                    } else {
-                        bzero(request, 1024);
-                        memcpy(request, buffer, 1023);
+                /* exactly fsize bytes, then the closing newline; a small body came whole with the header */
+                if (nhead > fsize) { end = header[hlen + fsize]; nhead = fsize; }
 
-                        fwrite(request, 1, n, uploaded); // if not first loop, write to file
-                    }
-
-                    bytes_read += n;  // keep count of bytes read
-                    if (bytes_read >= fsize) break;
+                if (receive_file(uploaded, fsize, header + hlen, nhead) == -1 ||
+                    (got - hlen <= fsize && read(fd_fs, &end, 1) != 1) || end != '\n') {
+                    close(uploaded); remove(fname);  // short or malformed body; keep no partial file
+                    strcpy(response, "RUP ERR\n");
 
-                    bzero(buffer, 1024);
-                    n = read(fd_fs, buffer, 1023);
+                } else {
+                    close(uploaded);
+                    strcpy(response, "RUP OK\n");
                 }
 
-                fseek(uploaded, 0, SEEK_SET);
-                ftruncate(fileno(uploaded), fsize);  // delete last char (\n)
-
-                fclose(uploaded);
-
                 chdir("..");
-
-                strcpy(response, "RUP OK\n");
             }
         }
     }
 
-    n = strlen(response);
-
-    while (n > 0) {  // write response
-        if ((nw = write(fd_fs, response, n)) <= 0) exit(1);
-        n -= nw; strcpy(response, &response[nw]);
-    }
+    write_all(response, strlen(response));
 }
 
 
 void delete_file() {  // delete file in fs
     char request[128], response[128];
-    char ruid[6], rtid[5], rfname[26];
+    char ruid[7], rtid[TID_MAX + 2], rfname[26];
     DIR *udir;
     FILE *todelete;
 
@@ -558,11 +1159,11 @@ void delete_file() {  // delete file in fs
     if ((n = read(fd_fs, buffer, 127)) > 0)
         strncpy(request, buffer, 127);  // read request
 
-    sscanf(request, "%s %s %s", ruid, rtid, rfname);
+    sscanf(request, "%6s %54s %25s", ruid, rtid, rfname);
 
     bzero(response, 128);
     if (strlen(ruid) != 5 || !is_only(NUMERIC, ruid) ||
-        strlen(rtid) != 4 || !is_only(NUMERIC, rtid) ||
+        !is_tid(rtid) ||
         !is_only(FILENAME, rfname))
         strcpy(response, "RDL ERR\n");  // format error
 
@@ -605,7 +1206,7 @@ void delete_file() {  // delete file in fs
 
 void remove_user() {  // remove user from fs
     char request[128], response[128];
-    char ruid[6], rtid[5];
+    char ruid[7], rtid[TID_MAX + 2];
     DIR *udir;
     struct dirent *udirent;
 
@@ -613,11 +1214,11 @@ void remove_user() {  // remove user from fs
     if ((n = read(fd_fs, buffer, 127)) > 0)
         strncpy(request, buffer, 127);  // read request
 
-    sscanf(request, "%s %s", ruid, rtid);
+    sscanf(request, "%6s %54s", ruid, rtid);
 
     bzero(response, 128);
     if (strlen(ruid) != 5 || !is_only(NUMERIC, ruid) ||
-        strlen(rtid) != 4 || !is_only(NUMERIC, rtid))
+        !is_tid(rtid))
         strcpy(response, "RRM ERR\n");  // format error
 
     else {
@@ -726,6 +1327,8 @@ int main(int argc, char const *argv[]){
     setup_fsserver();
     connect_to_as();
 
+    setup_validator();
+
     change_to_dusers();
 
     receive_requests();
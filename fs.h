@@ -1,6 +1,10 @@
 #ifndef FS_H
 #define FS_H
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
 
 #define IP_INVALID 0
 #define PORT_INVALID 1
@@ -14,6 +18,48 @@
 #define FILE_CHARS 6
 
 #define BACKLOG 100
+#define SENDFILE_MAX (1 << 30)  // bytes per sendfile() call
+#define COPY_CHUNK (256 * 1024)  // read/write fallback where sendfile() or splice() is refused
+#define PIPE_SIZE (1 << 20)  // UPL socket to file pipe
+
+#define VLB_MAX 32  // entries per batched validation (VLB)
+#define VLD_QUEUE 256  // validations waiting in the helper
+#define VLD_TIMEOUT 5000  // ms; then sub-servers get ERR
+#define WINDOW_MAX 1000  // ms
+#define TID_TABLE 4096  // tids pushed by as; direct mapped
+#define REPLICA_MAX 8  // -r as replicas sharing the VLD load
+#define REPLICA_TIMEOUT 500  // ms; then the entries go to the as
+
+#define SHARD_MAX 64  // -s map entries
+
+#define KEY_MAX 64  // -k token key bytes used
+#define TOKEN_FIXED 29  // op, expiry (8 hex), nonce (4 hex), mac (16 hex); fname follows
+#define TID_MAX (TOKEN_FIXED + 24)
+#define UPL_HEADER (5 + 1 + TID_MAX + 1 + 24 + 1 + 20 + 1 + 1)  // "uid tid fname size " ahead of the body, and NUL
+
+
+typedef struct shard {  // uids first..last are served by the as at ip:port
+    int first, last;
+    char ip[18], port[8];
+    struct sockaddr_in addr;
+} shard;
+
+
+typedef struct vld_entry {  // one sub-server waiting for its tid
+    char uid[6], tid[5];
+    struct sockaddr_un from;
+    socklen_t fromlen;
+    long long arrived;  // ms
+    int answered;
+    int retry;  // replica did not know the tid; ask the as
+} vld_entry;
+
+
+typedef struct tid_entry {  // tid pushed by as at AUT time
+    char uid[6], tid[5], op, fname[26];
+    long long expires;  // ms; 0 never
+} tid_entry;
+
 
 void usage();
 void kill_fs(int signum);
@@ -21,14 +67,37 @@ void protocol_error();
 void syntax_error(int error);
 int is_only(int which, char *str);
 void parse_args(int argc, char const *argv[]);
+void load_shards(char *path);
+shard *find_shard(char *uid);
+int known_as(struct in_addr *addr);
+void read_key(char *path);
+void token_mac(char *uid, char op, unsigned exp, unsigned nonce, char *fname, char *mac);
+void push_mac(char *uid, int tid, char op, unsigned exp, char *fname, char *mac);
+int is_tid(char *tid);
+int check_token(char *uid, char *tid);
 void connect_to_as();
 void setup_fsserver();
 void disconnect_from_as();
 void disconnect_fs();
 void change_to_dusers();
+long long now_ms();
+void setup_validator();
+void answer_entry(vld_entry *e, char *response);
+tid_entry *tid_slot(char *uid, char *tid);
+void receive_pushes();
+int lookup_tid(vld_entry *e);
+void retry_entry(vld_entry *e);
+void send_batch();
+void receive_cnf();
+void validator_loop();
 int validate(char *uid, char *tid);
 void list_files();
+void write_all(char *data, size_t len);
+int send_file(int fd, long long size);
 void retrive_file();
+int read_header(char *header, int max, int *got);
+int write_file(int fd, char *data, size_t len);
+int receive_file(int fd, long long size, char *head, int nhead);
 void upload_file();
 void delete_file();
 void remove_user();
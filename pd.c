@@ -28,6 +28,10 @@ struct timeval timeout;  // for timeout
 char pdip[18], pdport[8];
 char asip[18], asport[8];
 
+/* Shard map (-s); REG goes to the as owning the uid */
+shard shards[SHARD_MAX];
+int nshards = 0;
+
 /* User info */
 char uid[8], pass[10];
 
@@ -36,7 +40,7 @@ int registered_user = 0;
 
 
 void usage() {
-    fputs("usage: ./pd PDIP [-d PDport] [-n ASIP] [-p ASport]\n", stderr);
+    fputs("usage: ./pd PDIP [-d PDport] [-n ASIP] [-p ASport] [-s shardmap]\n", stderr);
     exit(1);
 }
 
@@ -88,7 +92,7 @@ int is_only(int which, char *str) {  // check if string is only numeric, alpha,
 void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
     int opt;
 
-    if (argc == 1 || argc > 8) usage();  // numargs in range
+    if (argc == 1 || argc > 10) usage();  // numargs in range
 
     /* default values */
     strncpy(pdip, argv[1], 16);
@@ -98,7 +102,7 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 
     if (!is_only(IP, pdip)) syntax_error(IP_INVALID);
 
-    while ((opt = getopt(argc, (char * const*) argv, "d:n:p:")) != -1) {
+    while ((opt = getopt(argc, (char * const*) argv, "d:n:p:s:")) != -1) {
         if (optarg[0] == '-') usage();
 
         switch (opt) {
@@ -126,6 +130,11 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 
                 break;
 
+            case 's':
+                load_shards(optarg);
+
+                break;
+
             default:
                 usage();
         }
@@ -133,6 +142,51 @@ void parse_args(int argc, char const *argv[]) {  // parse flags and flag args
 }
 
 
+void load_shards(char *path) {  // "first last ip port" per line; '#' starts a comment
+    char line[128], first[8], last[8], ip[18], port[8], *p;
+    FILE *map = fopen(path, "r");
+    int i;
+
+    if (!map) { fputs("Error: Could not read shard map. Exiting...\n", stderr); exit(1); }
+
+    while (fgets(line, 128, map)) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        bzero(first, 8); bzero(last, 8); bzero(ip, 18); bzero(port, 8);
+        if (nshards == SHARD_MAX || sscanf(p, "%7s %7s %17s %7s", first, last, ip, port) != 4 ||
+            strlen(first) != 5 || !is_only(NUMERIC, first) || strlen(last) != 5 || !is_only(NUMERIC, last) ||
+            atoi(first) > atoi(last) || !is_only(IP, ip) || strlen(port) == 0 || strlen(port) > 5 ||
+            !is_only(NUMERIC, port) || atoi(port) > 65535) {
+            fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+
+        for (i = 0; i < nshards; i++)
+            if (atoi(first) <= shards[i].last && atoi(last) >= shards[i].first) {
+                fputs("Error: Shard map ranges overlap. Exiting...\n", stderr); exit(1); }
+
+        shards[nshards].first = atoi(first);
+        shards[nshards].last = atoi(last);
+        strcpy(shards[nshards].ip, ip);
+        sprintf(shards[nshards].port, "%d", atoi(port));
+        nshards++;
+    }
+
+    fclose(map);
+
+    if (!nshards) { fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+}
+
+
+shard *find_shard(char *uid) {  // map entry covering uid; NULL if none
+    int u = atoi(uid), i;
+
+    for (i = 0; i < nshards; i++)
+        if (u >= shards[i].first && u <= shards[i].last) return &shards[i];
+
+    return NULL;
+}
+
+
 void connect_to_as() {  // standard udp connection setup to as
     fd_client = socket(AF_INET, SOCK_DGRAM, 0);
     if (fd_client == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
@@ -152,6 +206,19 @@ void connect_to_as() {  // standard udp connection setup to as
 }
 
 
+void switch_as(char *ip, char *port) {  // send to another as from now on
+    if (strcmp(ip, asip) == 0 && strcmp(port, asport) == 0) return;
+
+    strcpy(asip, ip);
+    strcpy(asport, port);
+
+    freeaddrinfo(res_client);
+
+    errcode = getaddrinfo(asip, asport, &hints_client, &res_client);
+    if (errcode != 0) { fputs("Error: Could not connect to AS. Exiting...\n", stderr); exit(1); }
+}
+
+
 void setup_pdserver() {  // set up server on pd to receive validation codes
     fd_server = socket(AF_INET, SOCK_DGRAM, 0);
     if (fd_server == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
@@ -182,23 +249,37 @@ void disconnect_pdserver() {  // disconnect pd server
 
 
 void register_user() {  // register user in as
-    char request[42];
+    char request[42], rip[18], rport[8];
+    int redirects = 0;
     pid_t pid, ppid;
+    shard *s;
+
+    if (nshards && (s = find_shard(uid))) switch_as(s->ip, s->port);  // as owning the uid
 
     sprintf(request, "REG %s %s %s %s\n", uid, pass, pdip, pdport);
 
-    n = sendto(fd_client, request, strlen(request), 0, res_client->ai_addr, res_client->ai_addrlen);
-    if (n == -1) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
+    /* uid lives on another as; follow one redirect (no map, or a stale one) */
+    do {
+        n = sendto(fd_client, request, strlen(request), 0, res_client->ai_addr, res_client->ai_addrlen);
+        if (n == -1) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
 
-    addrlen_server = sizeof(addr_server);
-    n = recvfrom(fd_client, buffer, 128, 0, (struct sockaddr*) &addr_server, &addrlen_server);
-    if (n == -1) { fputs("Error: Could not get response from server. Try again!\n", stderr); return; }
-    else buffer[n] = '\0';
+        addrlen_server = sizeof(addr_server);
+        n = recvfrom(fd_client, buffer, 128, 0, (struct sockaddr*) &addr_server, &addrlen_server);
+        if (n == -1) { fputs("Error: Could not get response from server. Try again!\n", stderr); return; }
+        else buffer[n] = '\0';
+
+        bzero(rip, 18); bzero(rport, 8);
+        if (sscanf(buffer, "RRG RDR %17s %7s", rip, rport) != 2 || !is_only(IP, rip) ||
+            !is_only(NUMERIC, rport) || redirects++) break;
+
+        switch_as(rip, rport);
+    } while (1);
 
     /* reply parsing */
     if (strcmp(buffer, "RRG OK\n") == 0) fputs("Registration successful!\n", stdout);
     if (strcmp(buffer, "RRG NOK\n") == 0) { message_error(REG); return; }
     if (strcmp(buffer, "ERR\n") == 0) { message_error(UNK); return; }
+    if (strcmp(buffer, "RRG OK\n") != 0) { message_error(UNK); return; }  // redirected again
 
     registered_user = 1;  // set register control flag
 
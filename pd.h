@@ -15,6 +15,14 @@
 #define ALPHANUMERIC 1
 #define IP 2
 
+#define SHARD_MAX 64  // -s map entries
+
+
+typedef struct shard {  // uids first..last are served by the as at ip:port
+    int first, last;
+    char ip[18], port[8];
+} shard;
+
 
 void usage();
 void kill_pdserver(int signum);
@@ -22,7 +30,10 @@ void syntax_error(int error);
 void message_error(int error);
 int is_only(int which, char *str);
 void parse_args(int argc, char const *argv[]);
+void load_shards(char *path);
+shard *find_shard(char *uid);
 void connect_to_as();
+void switch_as(char *ip, char *port);
 void setup_pdserver();
 void disconnect_from_as();
 void disconnect_pdserver();
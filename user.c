@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -31,16 +32,22 @@ extern int errno;
 char asip[18], asport[8];
 char fsip[18], fsport[8];
 
+/* Shard map (-s); login goes to the as owning the uid */
+shard shards[SHARD_MAX];
+int nshards = 0;
+
 /* User info */
 char uid[6], pass[9];
-int tid = 9999, rid = 9999;
+char tid[TID_MAX + 1] = "9999";  // 4 digits, or a signed token (-T)
+int rid = 9999;
+int token_mode = 0;  // ask as for signed tids
 
 /* Login control */
 int is_logged_in = 0;
 
 
 void usage() {
-    fputs("usage: ./user [-n ASIP] [-p ASport] [-m FSIP] [-q FSport]\n", stderr);
+    fputs("usage: ./user [-n ASIP] [-p ASport] [-m FSIP] [-q FSport] [-T] [-s shardmap]\n", stderr);
     exit(1);
 }
 
@@ -120,7 +127,7 @@ int is_only(int which, char *str) {  // check if string is only numeric, alpha,
 void parse_args(int argc, char const *argv[]) { // parse flags and flag args
     int opt;
 
-    if (argc > 9) usage();  // numargs in range
+    if (argc > 12) usage();  // numargs in range
 
     /* default values */
     strncpy(asip, "127.0.0.1", 16);
@@ -128,8 +135,8 @@ void parse_args(int argc, char const *argv[]) { // parse flags and flag args
     strncpy(fsip, "127.0.0.1", 16);
     strncpy(fsport, "59046", 6);
 
-    while ((opt = getopt(argc, (char * const*) argv, "n:p:m:q:")) != -1) {
-        if (optarg[0] == '-') usage();
+    while ((opt = getopt(argc, (char * const*) argv, "n:p:m:q:Ts:")) != -1) {
+        if (optarg && optarg[0] == '-') usage();
 
         switch (opt) {
             /* check flag; parse args
@@ -162,6 +169,16 @@ void parse_args(int argc, char const *argv[]) { // parse flags and flag args
 
                 break;
 
+            case 'T':
+                token_mode = 1;
+
+                break;
+
+            case 's':
+                load_shards(optarg);
+
+                break;
+
             default:
                 usage();
         }
@@ -169,6 +186,51 @@ void parse_args(int argc, char const *argv[]) { // parse flags and flag args
 }
 
 
+void load_shards(char *path) {  // "first last ip port" per line; '#' starts a comment
+    char line[128], first[8], last[8], ip[18], port[8], *p;
+    FILE *map = fopen(path, "r");
+    int i;
+
+    if (!map) { fputs("Error: Could not read shard map. Exiting...\n", stderr); exit(1); }
+
+    while (fgets(line, 128, map)) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        bzero(first, 8); bzero(last, 8); bzero(ip, 18); bzero(port, 8);
+        if (nshards == SHARD_MAX || sscanf(p, "%7s %7s %17s %7s", first, last, ip, port) != 4 ||
+            strlen(first) != 5 || !is_only(NUMERIC, first) || strlen(last) != 5 || !is_only(NUMERIC, last) ||
+            atoi(first) > atoi(last) || !is_only(IP, ip) || strlen(port) == 0 || strlen(port) > 5 ||
+            !is_only(NUMERIC, port) || atoi(port) > 65535) {
+            fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+
+        for (i = 0; i < nshards; i++)
+            if (atoi(first) <= shards[i].last && atoi(last) >= shards[i].first) {
+                fputs("Error: Shard map ranges overlap. Exiting...\n", stderr); exit(1); }
+
+        shards[nshards].first = atoi(first);
+        shards[nshards].last = atoi(last);
+        strcpy(shards[nshards].ip, ip);
+        sprintf(shards[nshards].port, "%d", atoi(port));
+        nshards++;
+    }
+
+    fclose(map);
+
+    if (!nshards) { fputs("Error: Invalid shard map. Exiting...\n", stderr); exit(1); }
+}
+
+
+shard *find_shard(char *uid) {  // map entry covering uid; NULL if none
+    int u = atoi(uid), i;
+
+    for (i = 0; i < nshards; i++)
+        if (u >= shards[i].first && u <= shards[i].last) return &shards[i];
+
+    return NULL;
+}
+
+
 void connect_to_as() {  // standard tcp connection setup to as
     fd_as = socket(AF_INET, SOCK_STREAM, 0);
     if (fd_as == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
@@ -185,6 +247,35 @@ void connect_to_as() {  // standard tcp connection setup to as
 }
 
 
+int reconnect_as() {  // as connection lost (restart); wait for it to come back; 0 if it does not
+    int i;
+
+    for (i = 0; i < RECONNECT_TRIES; i++) {
+        close(fd_as);
+
+        fd_as = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_as != -1 && connect(fd_as, res_as->ai_addr, res_as->ai_addrlen) == 0) return 1;
+
+        usleep(RECONNECT_WAIT * 1000);
+    }
+
+    return 0;
+}
+
+
+void switch_as(char *ip, char *port) {  // reconnect to another as; a login on the old one is dropped
+    if (strcmp(ip, asip) == 0 && strcmp(port, asport) == 0) return;
+
+    strcpy(asip, ip);
+    strcpy(asport, port);
+
+    disconnect_from_as();
+    connect_to_as();
+
+    is_logged_in = 0;
+}
+
+
 void connect_to_fs() {  // standard tcp connection setup to fs
     fd_fs = socket(AF_INET, SOCK_STREAM, 0);
     if (fd_fs == -1) { fputs("Error: Could not create socket. Exiting...\n", stderr); exit(1); }
@@ -216,32 +307,74 @@ void disconnect_from_fs() {  // standard tcp disconnect from fs
 void generate_rid() { rid = rand() % 9000 + 1000; }  // generate a random rid between 1000 and 9999
 
 
-void login(char *l_uid, char *l_pass) {  // login (as command)
+int as_send(char *request, char *response) {  // send request, read one response line on the current connection; -1 if it broke
+    int len = strlen(request);
+
+    if (write(fd_as, request, len) != len) return -1;
+
+    /* clear receive buffers, read response */
+    bzero(response, 128);
+    bzero(buffer, 128);
+    while ((n = read(fd_as, buffer, 127) > 0)) {
+        strncat(response, buffer, 127);
+        if (response[strlen(response) - 1] == '\n') break;
+    }
+
+    return strlen(response) ? 0 : -1;
+}
+
+
+void relogin() {  // logins do not survive an as restart; log in again on the new connection
     char request[20], response[128];
-    int len;
+
+    sprintf(request, "LOG %s %s\n", uid, pass);
+    if (as_send(request, response) == -1 || strcmp(response, "RLO OK\n") != 0) is_logged_in = 0;
+}
+
+
+int as_exchange(char *request, char *response) {  // as_send(); resent once on a new connection if the as went away
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (attempt && !reconnect_as()) return -1;
+        if (attempt && is_logged_in) relogin();
+
+        if (as_send(request, response) == 0) return 0;
+    }
+
+    return -1;
+}
+
+
+void login(char *l_uid, char *l_pass) {  // login (as command)
+    char request[20], response[128], rip[18], rport[8];
+    int redirects = 0;
+    shard *s;
 
     /* stop uid and pass from overflowing */
     strncpy(uid, l_uid, 5);
     strncpy(pass, l_pass, 8);
 
+    if (nshards && (s = find_shard(uid))) switch_as(s->ip, s->port);  // as owning the uid
+
     sprintf(request, "LOG %s %s\n", uid, pass);
 
-    len = strlen(request);
+    /* uid lives on another as; follow one redirect (no map, or a stale one) */
+    do {
+        if (as_exchange(request, response) == -1) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
 
-    if (write(fd_as, request, len) != len) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
+        bzero(rip, 18); bzero(rport, 8);
+        if (sscanf(response, "RLO RDR %17s %7s", rip, rport) != 2 || !is_only(IP, rip) ||
+            !is_only(NUMERIC, rport) || redirects++) break;
 
-    /* clear receive buffers, read response */
-    bzero(response, 128);
-    bzero(buffer, 128);
-    while ((n = read(fd_as, buffer, 127) > 0)) {
-        strncat(response, buffer, 127);
-        if (response[strlen(response) - 1] == '\n') break;
-    }
+        switch_as(rip, rport);
+    } while (1);
 
     /* reply parsing */
     if (strcmp(response, "RLO OK\n") == 0) fputs("You are now logged in!\n", stdout);
     if (strcmp(response, "RLO NOK\n") == 0) { message_error(LOGIN); return; }
     if (strcmp(response, "ERR\n") == 0) { message_error(UNK); return; }
+    if (strcmp(response, "RLO OK\n") != 0) { message_error(UNK); return; }  // redirected again
 
     is_logged_in = 1;   // set login control flag
 }
@@ -263,15 +396,7 @@ void request_operation(char *fop, char *fname) {  // request operation (as comma
     len = strlen(request);
     if (len > 42) { fputs("Error: Filename is too long. Try again!\n", stderr); return; }
 
-    if (write(fd_as, request, len) != len) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
-
-    /* clear receive buffers, read response */
-    bzero(response, 128);
-    bzero(buffer, 128);
-    while ((n = read(fd_as, buffer, 127) > 0)) {
-        strncat(response, buffer, 127);
-        if (response[strlen(response) - 1] == '\n') break;
-    }
+    if (as_exchange(request, response) == -1) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
 
     /* reply parsing */
     if (strcmp(response, "RRQ OK\n") == 0) { fputs("VC successfully sent (check PD)\n", stdout); return; }
@@ -288,30 +413,20 @@ void request_operation(char *fop, char *fname) {  // request operation (as comma
 void val_operation(char *vc) {  // validate operation (as command)
     char request[128], response[128];
     char pcode[6];
-    int len;
 
     bzero(request, 128);
-    sprintf(request, "AUT %s %d %s\n", uid, rid, vc);
-
-    len = strlen(request);
+    if (token_mode) sprintf(request, "AUT %s %d %s T\n", uid, rid, vc);  // as without a key answers a plain tid
+    else sprintf(request, "AUT %s %d %s\n", uid, rid, vc);
 
-    if (write(fd_as, request, len) != len) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
-
-    /* clear receive buffers, read response */
-    bzero(response, 128);
-    bzero(buffer, 128);
-    while ((n = read(fd_as, buffer, 127) > 0)) {
-        strncat(response, buffer, 127);
-        if (response[strlen(response) - 1] == '\n') break;
-    }
+    if (as_exchange(request, response) == -1) { fputs("Error: Could not send request. Try again!\n", stderr); return; }
 
     /* reply parsing */
     if (strcmp(response, "RAU 0\n") == 0) { fputs("Error: Authentication failed. Try again!\n", stderr); return; }
     if (strcmp(response, "ERR\n") == 0) { message_error(UNK); return; }
 
-    sscanf(response, "%5s %d\n", pcode, &tid);
+    sscanf(response, "%5s %53s\n", pcode, tid);
 
-    if (strcmp(pcode, "RAU") == 0) fprintf(stdout, "Authenticated! (TID = %04d)\n", tid);
+    if (strcmp(pcode, "RAU") == 0) fprintf(stdout, "Authenticated! (TID = %s)\n", tid);
     else message_error(UNK);
 
 }
@@ -325,7 +440,7 @@ void list_files() {  // list files (fs operation)
     int i = 0, len, offset = 0, first = 1;
 
     bzero(request, 128);
-    sprintf(request, "LST %s %04d\n", uid, tid);
+    sprintf(request, "LST %s %s\n", uid, tid);
 
     connect_to_fs();
 
@@ -394,11 +509,11 @@ void retrieve_file(char *fname) {  // retrieve file (fs operation)
     char request[128], response[1024];
     char pcode[6], status[6];
     FILE *file;
-    int fsize;
-    int len, offset = 0, bytes_read = 0, first = 1;
+    long long fsize, bytes_read = 0;
+    int len, offset = 0, first = 1;
 
     bzero(request, 128);
-    sprintf(request, "RTV %s %04d %s\n", uid, tid, fname);
+    sprintf(request, "RTV %s %s %s\n", uid, tid, fname);
 
     connect_to_fs();
 
@@ -440,7 +555,7 @@ void retrieve_file(char *fname) {  // retrieve file (fs operation)
 
         if (first) {  // if first loop
             /* extract file info */
-            sscanf(response, "%s %s %d %n", pcode, status, &fsize, &offset);
+            sscanf(response, "%s %s %lld %n", pcode, status, &fsize, &offset);
 
             if (strcmp(pcode, "RRT") != 0 || strcmp(status, "OK") != 0) {
                 message_error(UNK); fclose(file); remove(fname); return; }
@@ -472,10 +587,10 @@ void retrieve_file(char *fname) {  // retrieve file (fs operation)
 
 
 void upload_file(char *fname) {  // upload file (fs operation)
-    char request[1024], response[128];
+    char request[UPL_CHUNK], response[128];
     FILE *file;
-    int fsize;
-    int len;
+    long long fsize;
+    int len, sent;
 
     /* open file to upload in read mode */
     file = fopen(fname, "r");
@@ -483,13 +598,13 @@ void upload_file(char *fname) {  // upload file (fs operation)
         fputs("Error: File not found. Try again!\n", stderr); return; }
 
     /* get file size */
-    fseek(file, 0, SEEK_END);
-    fsize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    fseeko(file, 0, SEEK_END);
+    fsize = ftello(file);
+    fseeko(file, 0, SEEK_SET);
 
     /* write file info to socket */
-    bzero(request, 1024);
-    sprintf(request, "UPL %s %04d %s %d ", uid, tid, fname, fsize);
+    bzero(request, 128);
+    sprintf(request, "UPL %s %s %s %lld ", uid, tid, fname, fsize);
 
     connect_to_fs();
 
@@ -498,15 +613,14 @@ void upload_file(char *fname) {  // upload file (fs operation)
 
     /* while not end of file, write to socket */
     while (!feof(file)) {
-        bzero(request, 1024);
-        n = fread(request, 1, 1023, file);
+        n = fread(request, 1, UPL_CHUNK, file);
 
-        while (n > 0 && errno != ECONNRESET) {  // write response (ignore fs disconnect)
-            if ((nw = write(fd_fs, request, n)) <= 0 && errno != ECONNRESET) {
+        for (sent = 0; sent < n && errno != ECONNRESET; sent += nw) {  // write chunk (ignore fs disconnect)
+            if ((nw = write(fd_fs, request + sent, n - sent)) <= 0 && errno != ECONNRESET) {
                 fputs("Error: Could not send request. Try again!\n", stderr);
-                disconnect_from_fs(); return;
-
-            } n -= nw; strcpy(request, &request[nw]);
+                fclose(file); disconnect_from_fs(); return;
+            }
+            if (nw <= 0) break;
         }
 
     } if (errno != ECONNRESET) write(fd_fs, "\n", 1);
@@ -524,7 +638,7 @@ void upload_file(char *fname) {  // upload file (fs operation)
     /* reply parsing */
     if (strcmp(response, "ERR\n") == 0) message_error(UNK);
     if (strcmp(response, "RUP OK\n") == 0)
-        fprintf(stdout, "Uploaded %s (%d bytes)\n", fname, fsize);
+        fprintf(stdout, "Uploaded %s (%lld bytes)\n", fname, fsize);
     if (strcmp(response, "RUP NOK\n") == 0)
         fprintf(stdout, "Error: User %s does not exist in FS.\n", uid);
     if (strcmp(response, "RUP DUP\n") == 0)
@@ -546,7 +660,7 @@ void delete_file(char *fname) {  // delete file (fs operation)
     int len;
 
     bzero(request, 128);
-    sprintf(request, "DEL %s %04d %s\n", uid, tid, fname);
+    sprintf(request, "DEL %s %s %s\n", uid, tid, fname);
 
     connect_to_fs();
 
@@ -591,7 +705,7 @@ void remove_user() {  // remove user (fs operation)
     int len;
 
     bzero(request, 128);
-    sprintf(request, "REM %s %04d\n", uid, tid);
+    sprintf(request, "REM %s %s\n", uid, tid);
 
     connect_to_fs();
 
@@ -622,6 +736,70 @@ void remove_user() {  // remove user (fs operation)
 }
 
 
+void bulk_register(char *path) {  // provision users from "uid pass pdip pdport" lines (as admin command)
+    char line[128], header[16], *request, *response, *cur, *end;
+    int k, len, used, lines, total = 0, ok = 0;
+    FILE *records;
+
+    if (!(records = fopen(path, "r"))) { fputs("Error: Could not open file. Try again!\n", stderr); return; }
+
+    request = malloc(16 + BULK_MAX * 128);
+    response = malloc(16 + BULK_MAX * BULK_LINE);
+    if (!request || !response) { fputs("Error: Out of memory. Try again!\n", stderr); exit(1); }
+
+    while (1) {
+        /* next batch; the as flushes it to disk once */
+        for (k = 0, len = 16; k < BULK_MAX && fgets(line, 126, records); ) {
+            if (strspn(line, " \t\n") == strlen(line)) continue;  // blank line
+            if (!strchr(line, '\n')) strcat(line, "\n");
+
+            strcpy(request + len, line);
+            len += strlen(line);
+            k++;
+        }
+
+        if (!k) break;
+
+        /* header goes right before the records; one write, so nagle does not hold the batch back */
+        sprintf(header, "BRG %d\n", k);
+        cur = request + 16 - strlen(header);
+        memcpy(cur, header, strlen(header));
+        len -= cur - request;
+
+        if (write(fd_as, cur, len) != len) { fputs("Error: Could not send request. Try again!\n", stderr); break; }
+
+        /* "RBR k" and one result line per record */
+        for (used = lines = 0; lines < k + 1 && used < 16 + BULK_MAX * BULK_LINE - 1; ) {
+            if ((n = read(fd_as, response + used, 16 + BULK_MAX * BULK_LINE - 1 - used)) <= 0) break;
+
+            for (cur = response + used; cur < response + used + n; cur++) lines += *cur == '\n';
+            used += n;
+
+            if (strncmp(response, "RBR ERR\n", 8) == 0 || strncmp(response, "ERR\n", 4) == 0) break;
+        }
+
+        response[used] = '\0';
+
+        if (lines < k + 1) { message_error(UNK); break; }  // refused (not local?) or cut short
+
+        for (cur = strchr(response, '\n') + 1; (end = strchr(cur, '\n')); cur = end + 1) {
+            *end = '\0';
+
+            if (strlen(cur) > 3 && strcmp(cur + strlen(cur) - 3, " OK") == 0) ok++;
+            else fprintf(stdout, "  failed: %s\n", cur);
+        }
+
+        total += k;
+    }
+
+    fprintf(stdout, "Registered %d of %d users\n", ok, total);
+
+    free(request);
+    free(response);
+    fclose(records);
+}
+
+
 void read_commands() {  // read commands from stdin
     char command[128];
     char action[10];
@@ -679,6 +857,9 @@ void read_commands() {  // read commands from stdin
         } else if((strcmp(action, "remove") == 0) || (strcmp(action, "x") == 0)) {
             remove_user();
 
+        } else if (strcmp(action, "bulk") == 0) {
+            bulk_register(arg_1);
+
         } else if (strcmp(action, "exit") == 0) return;
 
         else fputs("Invalid action!\n", stdout);  // command not recognized
@@ -691,6 +872,8 @@ int main (int argc, char const *argv[]){
 
     srand(time(NULL));  // init random generator
 
+    signal(SIGPIPE, SIG_IGN);  // lost as connection is handled by as_exchange()
+
     connect_to_as();
 
     read_commands();
@@ -23,16 +23,37 @@
 #define FILENAME 5
 #define FILE_CHARS 6
 
+#define TID_MAX 53  // signed token; classic tids are 4 digits
+#define SHARD_MAX 64  // -s map entries
+#define BULK_MAX 1024  // records per BRG batch; as limit
+#define BULK_LINE 48  // longest per-record result line
+#define RECONNECT_TRIES 20  // as restarts; one try every RECONNECT_WAIT ms
+#define RECONNECT_WAIT 250
+#define UPL_CHUNK (64 * 1024)  // file bytes per write to the fs
+
+
+typedef struct shard {  // uids first..last are served by the as at ip:port
+    int first, last;
+    char ip[18], port[8];
+} shard;
+
 
 void usage();
 void syntax_error(int error);
 void message_error(int error);
 void parse_args(int argc, char const *argv[]);
+void load_shards(char *path);
+shard *find_shard(char *uid);
 void connect_to_as();
+int reconnect_as();
+void switch_as(char *ip, char *port);
 void connect_to_fs();
 void disconnect_from_as();
 void disconnect_from_fs();
 void generate_rid();
+int as_send(char *request, char *response);
+void relogin();
+int as_exchange(char *request, char *response);
 void login(char *l_uid, char *l_pass);
 void request_operation(char *fop, char *fname);
 void val_operation(char *vc);
@@ -41,6 +62,7 @@ void retrieve_file(char *fname);
 void upload_file(char *fname);
 void delete_file(char *fname);
 void remove_user();
+void bulk_register(char *path);
 void read_commands();
 
 